@@ -8,22 +8,247 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <math.h>
 #include <vector>
 #include <string>
 #include <chrono>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <atomic>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "llama.h"
 
+/* ----------------- CONTADOR DE ASIGNACIONES (depuración) ----------------- */
+// Asignaciones de heap del hilo actual en los sitios propios del bucle por
+// token (crecimiento de buffers, objetos nuevos para el callback). No se
+// reemplaza el operator new global: la extensión se carga dentro del proceso
+// de otro y no debe cambiar su asignador; las de llama.cpp se miden con un
+// perfilador de heap.
+static thread_local long g_hot_allocs = 0;
+#define HOT_ALLOC() (g_hot_allocs++)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct BatchEngine;
+struct PieceTable;
+
+/* ----------------- PARÁMETROS DE MUESTREO ----------------- */
+// Tupla normalizada que define una cadena de samplers. Sólo campos de 4 bytes
+// (sin relleno), así se compara con memcmp.
+typedef struct {
+    float   temp;
+    float   top_p;
+    float   min_p;
+    float   repeat_penalty;
+    float   presence_penalty;
+    float   frequency_penalty;
+    float   mirostat_tau;
+    float   mirostat_eta;
+    int32_t top_k;
+    int32_t repeat_last_n;
+    int32_t mirostat;
+    int32_t seed;
+    int32_t grammar;        // Id de StageEntry de la gramática (0 = ninguna)
+    int32_t bias;           // Id de StageEntry del logit bias (0 = ninguno)
+} SamplerKey;
+
+// Perfil con nombre (llama::profile): parámetros de la cadena + num_predict
+typedef struct {
+    SamplerKey key;
+    int32_t    n_predict;
+} SamplerProfile;
+
+#define SAMPLER_CACHE_SIZE 8
+
+typedef struct {
+    SamplerKey             key;
+    struct llama_sampler  *chain;      // NULL = entrada libre
+    unsigned long          last_use;
+} SamplerCacheEntry;
+
+// Etapa compilada de la cadena: gramática (-grammar / -json_schema) o logit
+// bias (-logit_bias / -ban_strings). Las cadenas clonan el prototipo, así una
+// petición repetida no vuelve a parsear ni a tokenizar.
+#define STAGE_CACHE_SIZE 16
+
+typedef struct {
+    int32_t                id;         // Nunca se reutiliza: forma parte de SamplerKey
+    struct llama_sampler  *proto;
+    unsigned long          last_use;
+} StageEntry;
+
+/* ----------------- HISTOGRAMAS DE LATENCIA ----------------- */
+// Buckets fijos en microsegundos: exactos por debajo de 8us y luego 8 por
+// octava (error relativo <= 12.5%), hasta 2^32us en 240 contadores. Registrar
+// cuesta un clz y un incremento; se acumulan por handle hasta llama::stats -reset.
+#define LAT_BUCKETS 240
+
+enum { LAT_TTFT = 0, LAT_INTER_TOKEN, LAT_SAMPLE, LAT_DECODE, LAT_CALLBACK, LAT_COUNT };
+
+typedef struct {
+    uint32_t     counts[LAT_BUCKETS];
+    Tcl_WideInt  n;
+    double       sum_us;
+    double       max_us;
+} LatencyHist;
+
+// Nanosegundos de steady_clock: entero para que LlamaState siga siendo trivial
+typedef int64_t LatTime;
+
+static inline LatTime lat_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline int lat_bucket(uint32_t us) {
+    if (us < 8) return (int)us;
+    int msb = 31 - __builtin_clz(us);
+    return (msb - 2) * 8 + (int)((us >> (msb - 3)) & 7);
+}
+
+static inline void lat_record(LatencyHist *h, double us) {
+    uint32_t v = (us >= 4294967295.0) ? 0xffffffffu : (uint32_t)us;
+    h->counts[lat_bucket(v)]++;
+    h->n++;
+    h->sum_us += us;
+    if (us > h->max_us) h->max_us = us;
+}
+
+static inline void lat_span(LatencyHist *h, LatTime t0, LatTime t1) {
+    lat_record(h, (t1 - t0) / 1000.0);
+}
+
+static inline void lat_since(LatencyHist *h, LatTime t0) {
+    lat_span(h, t0, lat_now());
+}
+
+/* ----------------- TRAZA (llama::trace) ----------------- */
+// Eventos "X" (duración completa) del formato Chrome trace-event, visibles en
+// Perfetto o chrome://tracing. Cualquier hilo los publica sin locks en un anillo
+// acotado (cola MPSC con número de secuencia por celda); un hilo escritor lo
+// vacía al archivo cada TRACE_FLUSH_MS. Si el anillo se llena el evento se
+// descarta y se cuenta. Apagada, cada punto de traza cuesta una carga atómica.
+
+#define TRACE_RING_SIZE 65536   // Potencia de 2
+#define TRACE_FLUSH_MS  10
+
+typedef struct {
+    std::atomic<uint64_t> seq;
+    const char *name;       // Literal estático
+    int64_t     ts_ns;
+    int64_t     dur_ns;
+    int64_t     arg;        // -1 = sin argumento
+    uint32_t    tid;
+} TraceSlot;
+
+static std::atomic<int>      trace_on(0);
+static std::atomic<uint64_t> trace_head(0);     // Próxima celda a reservar
+static uint64_t              trace_tail = 0;    // Próxima celda a leer (sólo el consumidor)
+static TraceSlot            *trace_ring = NULL; // Nunca se libera: un productor tardío puede tocarlo
+static std::atomic<uint64_t> trace_dropped(0);
+static std::atomic<uint32_t> trace_next_tid(1);
+
+TCL_DECLARE_MUTEX(trace_mutex)          // start/stop y el consumidor
+static FILE        *trace_file = NULL;
+static int64_t      trace_t0 = 0;
+static uint64_t     trace_written = 0;
+static Tcl_ThreadId trace_writer;
+static std::atomic<int> trace_writer_stop(0);
+
+static inline int trace_enabled() {
+    return trace_on.load(std::memory_order_relaxed);
+}
+
+static uint32_t trace_tid() {
+    static thread_local uint32_t tid = 0;
+    if (!tid) tid = trace_next_tid.fetch_add(1);
+    return tid;
+}
+
+static void trace_emit(const char *name, LatTime t0, LatTime t1, int64_t arg) {
+    if (!trace_enabled()) return;
+    uint64_t pos = trace_head.load(std::memory_order_relaxed);
+    TraceSlot *slot;
+    for (;;) {
+        slot = &trace_ring[pos & (TRACE_RING_SIZE - 1)];
+        int64_t dif = (int64_t)(slot->seq.load(std::memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (trace_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            trace_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = trace_head.load(std::memory_order_relaxed);
+        }
+    }
+    slot->name = name;
+    slot->ts_ns = t0;
+    slot->dur_ns = t1 - t0;
+    slot->arg = arg;
+    slot->tid = trace_tid();
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+// t0 para trace_end: 0 si la traza está apagada (no se lee el reloj)
+static inline LatTime trace_begin() {
+    return trace_enabled() ? lat_now() : 0;
+}
+
+static inline void trace_end(const char *name, LatTime t0, int64_t arg = -1) {
+    if (t0) trace_emit(name, t0, lat_now(), arg);
+}
+
+// Vacía el anillo; con trace_file NULL sólo descarta. Llamar con trace_mutex tomado.
+static void trace_drain() {
+    for (;;) {
+        TraceSlot *slot = &trace_ring[trace_tail & (TRACE_RING_SIZE - 1)];
+        if (slot->seq.load(std::memory_order_acquire) != trace_tail + 1) break;
+        if (trace_file) {
+            fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"llama\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%.3f,\"dur\":%.3f",
+                    trace_written ? ",\n" : "", slot->name, slot->tid,
+                    (slot->ts_ns - trace_t0) / 1000.0, slot->dur_ns / 1000.0);
+            if (slot->arg >= 0) fprintf(trace_file, ",\"args\":{\"n\":%lld}", (long long)slot->arg);
+            fputc('}', trace_file);
+            trace_written++;
+        }
+        slot->seq.store(trace_tail + TRACE_RING_SIZE, std::memory_order_release);
+        trace_tail++;
+    }
+}
+
+static Tcl_ThreadCreateType trace_writer_proc(ClientData cd) {
+    while (!trace_writer_stop.load()) {
+        Tcl_Sleep(TRACE_FLUSH_MS);
+        Tcl_MutexLock(&trace_mutex);
+        trace_drain();
+        Tcl_MutexUnlock(&trace_mutex);
+    }
+    TCL_THREAD_CREATE_RETURN;
+}
+
 /* ----------------- ESTRUCTURA DE ESTADO DE IK'NAL ----------------- */
+#define STATE_TAG 0x5854434cU
+
 typedef struct {
-    struct llama_model * model;
+    unsigned int tag;                 // STATE_TAG: distingue el handle de los de modelo/índice/petición
+    struct llama_model * model;       // Pesos de model_entry (compartidos)
+    struct ModelEntry * model_entry;  // Referencia en el registro de modelos
     struct llama_context * ctx;
-    struct llama_sampler * sampler;
+    struct llama_sampler * sampler;   // Apunta a una entrada de sampler_cache
     const struct llama_vocab * vocab;
+    struct PieceTable * pieces;       // Tabla de piezas compartida por modelo
     
     float   temp;
     int32_t top_k;
@@ -43,13 +268,105 @@ typedef struct {
     int     n_past;
     int     verbose;
 
+    // Tokens residentes en el KV cache (secuencia 0), en orden de posición.
+    // Invariante: kv_tokens->size() == n_past
+    std::vector<llama_token> *kv_tokens;
+
+    // Cadenas ya construidas, indexadas por sus parámetros (LRU)
+    SamplerCacheEntry sampler_cache[SAMPLER_CACHE_SIZE];
+    unsigned long     sampler_tick;
+    Tcl_WideInt       n_sampler_hits;
+    Tcl_WideInt       n_sampler_builds;
+    
+    // Etapas compiladas, por contenido fuente ("gbnf:", "json:", "bias:")
+    std::map<std::string, StageEntry> *stages;
+    StageEntry       *grammar;          // Las de la petición actual (NULL = ninguna)
+    StageEntry       *bias;
+    int32_t           stage_next_id;
+    Tcl_WideInt       n_grammar_hits;
+    Tcl_WideInt       n_grammar_compiles;
+    Tcl_WideInt       n_bias_hits;
+    Tcl_WideInt       n_bias_compiles;
+
+    // Perfiles de muestreo con nombre
+    std::map<std::string, SamplerProfile> *profiles;
+
+    // Batch de un token reutilizado por el bucle de generación (sin malloc por token)
+    struct llama_batch tok_batch;
+
+    // Motor multi-secuencia (llama::batch), creado al primer submit
+    struct BatchEngine *engine;
+
+    // Hay una petición -async usando el contexto en un hilo de trabajo
+    int     busy;
+
+    // Política de context shift: al llenarse n_ctx se conservan los primeros
+    // n_keep tokens y se descarta la mitad más antigua del resto
+    int     ctx_shift;
+    int     n_keep;
+
     // Métricas de Telemetría (v7.0)
     double  t_eval_ms;    // Tiempo de ingestión del prompt
     double  t_gen_ms;     // Tiempo de generación de tokens
     int     n_eval;       // Tokens ingeridos (prompt)
     int     n_gen;        // Tokens generados (respuesta)
+    int     n_reused;     // Tokens del prompt reutilizados del KV cache
+    long    n_gen_allocs; // Asignaciones de heap dentro del bucle de generación
+    
+    // Decodificación especulativa: última llamada, acumulados y referencia sin borrador
+    int     n_drafted;
+    int     n_accepted;
+    int     n_spec_steps;     // Decodes del objetivo con verificación
+    int     spec_mode;        // SPEC_NONE / SPEC_DRAFT / SPEC_LOOKUP en la última llamada
+    int     draft_disabled;   // El borrador falló y la llamada siguió sin especular
+    Tcl_WideInt n_drafted_total;
+    Tcl_WideInt n_accepted_total;
+    double  gen_tps_plain;
+    
+    // Context shift: en la última llamada y acumulados
+    int     n_ctx_shifts;
+    Tcl_WideInt n_ctx_shifts_total;
+    Tcl_WideInt n_ctx_discarded_total;
+
+    // Acumulados desde init / clear_cache (tasa de aciertos del prefijo)
+    Tcl_WideInt n_reused_total;
+    Tcl_WideInt n_eval_total;
+    
+    // Embeddings (llama::embed): habilitado en init, última llamada y acumulados
+    int     embeddings;
+    int     n_embed_texts;
+    int     n_embed_tokens;
+    double  t_embed_ms;
+    Tcl_WideInt n_embed_texts_total;
+    double  t_embed_ms_total;
+    
+    // KV cache tal como se creó el contexto (para llama::info)
+    enum ggml_type type_k;
+    enum ggml_type type_v;
+    int     flash_attn;
+    int     offload_kqv;
+    double  t_warmup_ms;      // 0 si no hubo warmup
+    
+    // Latencias acumuladas (llama::stats). t_request marca el inicio de la
+    // ingestión; el primer token entregado después da el TTFT.
+    LatencyHist lat[LAT_COUNT];
+    LatTime     t_request;
+    LatTime     t_last_token;
+    int         lat_first;        // El próximo token entregado es el primero
 } LlamaState;
 
+// Resuelve un handle de contexto; rechaza los de llama::model, llama::index y
+// llama::request, que también son comandos "llama..." con clientData propio.
+static LlamaState *state_from_obj(Tcl_Interp *interp, Tcl_Obj *obj) {
+    Tcl_CmdInfo info;
+    if (Tcl_GetCommandInfo(interp, Tcl_GetString(obj), &info) == 0 ||
+        !info.objClientData || ((LlamaState*)info.objClientData)->tag != STATE_TAG) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
+        return NULL;
+    }
+    return (LlamaState*)info.objClientData;
+}
+
 /* ----------------- VALORES POR DEFECTO ----------------- */
 static void set_defaults(LlamaState *state) {
     state->temp              = 0.80f;
@@ -74,559 +391,3604 @@ static void set_defaults(LlamaState *state) {
     state->t_gen_ms  = 0.0;
     state->n_eval    = 0;
     state->n_gen     = 0;
+    state->n_reused  = 0;
+    state->n_reused_total = 0;
+    state->n_eval_total   = 0;
 }
 
-/* ----------------- MODULADOR DE OPCIONES (APPLY_OPTIONS) ----------------- */
-static void apply_options(Tcl_Interp *interp, Tcl_Obj *options_obj, LlamaState *state) {
-    Tcl_Obj *val = NULL, *k = NULL;
-    #define GET_D_FLOAT(name, target) \
-        k = Tcl_NewStringObj(name, -1); Tcl_IncrRefCount(k); \
-        if (options_obj && Tcl_DictObjGet(interp, options_obj, k, &val) == TCL_OK && val) { \
-            double d; if (Tcl_GetDoubleFromObj(interp, val, &d) == TCL_OK) target = (float)d; \
-        } Tcl_DecrRefCount(k);
-    #define GET_D_INT(name, target) \
-        k = Tcl_NewStringObj(name, -1); Tcl_IncrRefCount(k); \
-        if (options_obj && Tcl_DictObjGet(interp, options_obj, k, &val) == TCL_OK && val) { \
-            int i; if (Tcl_GetIntFromObj(interp, val, &i) == TCL_OK) target = (int32_t)i; \
-        } Tcl_DecrRefCount(k);
+/* ----------------- CADENA DE SAMPLERS ----------------- */
+// Construye una cadena nueva con los parámetros de 'key' y las etapas dadas
+static struct llama_sampler *build_sampler_chain_key(const LlamaState *state, const SamplerKey *key,
+                                                     const StageEntry *grammar, const StageEntry *bias) {
+    struct llama_sampler_chain_params sparams = llama_sampler_chain_default_params();
+    struct llama_sampler *chain = llama_sampler_chain_init(sparams);
+    // Bias y gramática van primero: ajustan y enmascaran antes de recortar
+    if (bias) llama_sampler_chain_add(chain, llama_sampler_clone(bias->proto));
+    if (grammar) llama_sampler_chain_add(chain, llama_sampler_clone(grammar->proto));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(key->temp));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(key->top_k));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(key->top_p, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_min_p(key->min_p, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_penalties(key->repeat_last_n, key->repeat_penalty, key->presence_penalty, key->frequency_penalty));
+    if (key->mirostat == 1) llama_sampler_chain_add(chain, llama_sampler_init_mirostat(llama_vocab_n_tokens(state->vocab), key->seed, key->mirostat_tau, key->mirostat_eta, 100));
+    else if (key->mirostat == 2) llama_sampler_chain_add(chain, llama_sampler_init_mirostat_v2(key->seed, key->mirostat_tau, key->mirostat_eta));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(key->seed));
+    return chain;
+}
 
-    if (options_obj) {
-        GET_D_FLOAT("temperature",      state->temp);
-        GET_D_INT(  "top_k",            state->top_k);
-        GET_D_FLOAT("top_p",            state->top_p);
-        GET_D_FLOAT("min_p",            state->min_p);
-        GET_D_FLOAT("repeat_penalty",   state->repeat_penalty);
-        GET_D_INT(  "repeat_last_n",    state->repeat_last_n);
-        GET_D_INT(  "num_predict",      state->n_predict);
-        GET_D_INT(  "mirostat",         state->mirostat);
-        GET_D_FLOAT("mirostat_tau",     state->mirostat_tau);
-        GET_D_FLOAT("mirostat_eta",     state->mirostat_eta);
-        GET_D_INT(  "seed",             state->seed);
-        
-        // Validación de rangos con clamping (v6.9)
-        if (state->temp < 0.0f) state->temp = 0.0f;
-        if (state->temp > 2.0f) state->temp = 2.0f;
-        
-        if (state->top_k < 1) state->top_k = 1;
-        
-        if (state->top_p < 0.0f) state->top_p = 0.0f;
-        if (state->top_p > 1.0f) state->top_p = 1.0f;
-        
-        if (state->min_p < 0.0f) state->min_p = 0.0f;
-        if (state->min_p > 1.0f) state->min_p = 1.0f;
-        
-        if (state->repeat_penalty < 0.0f) state->repeat_penalty = 1.0f;
-        
-        if (state->n_predict < -1) state->n_predict = -1;
+static void sampler_key_from_state(const LlamaState *state, SamplerKey *key);
+
+// Construye una cadena nueva con los parámetros actuales del handle
+static struct llama_sampler *build_sampler_chain(LlamaState *state) {
+    SamplerKey key;
+    sampler_key_from_state(state, &key);
+    return build_sampler_chain_key(state, &key, state->grammar, state->bias);
+}
+
+/* ----------------- HANDLE OCUPADO (-async) ----------------- */
+// Rechaza operaciones sobre el contexto mientras una petición -async lo usa
+static int check_idle(Tcl_Interp *interp, LlamaState *state) {
+    if (state->busy) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Handle busy: an -async request is running (use llama::request wait or cancel)", -1));
+        return TCL_ERROR;
     }
+    return TCL_OK;
+}
 
-    if (state->sampler != NULL) llama_sampler_free(state->sampler);
-    struct llama_sampler_chain_params sparams = llama_sampler_chain_default_params();
-    state->sampler = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(state->sampler, llama_sampler_init_temp(state->temp));
-    llama_sampler_chain_add(state->sampler, llama_sampler_init_top_k(state->top_k));
-    llama_sampler_chain_add(state->sampler, llama_sampler_init_top_p(state->top_p, 1));
-    llama_sampler_chain_add(state->sampler, llama_sampler_init_min_p(state->min_p, 1));
-    llama_sampler_chain_add(state->sampler, llama_sampler_init_penalties(state->repeat_last_n, state->repeat_penalty, state->presence_penalty, state->frequency_penalty));
-    if (state->mirostat == 1) llama_sampler_chain_add(state->sampler, llama_sampler_init_mirostat(llama_vocab_n_tokens(state->vocab), state->seed, state->mirostat_tau, state->mirostat_eta, 100));
-    else if (state->mirostat == 2) llama_sampler_chain_add(state->sampler, llama_sampler_init_mirostat_v2(state->seed, state->mirostat_tau, state->mirostat_eta));
-    llama_sampler_chain_add(state->sampler, llama_sampler_init_dist(state->seed));
-}
-
-static void fill_batch(struct llama_batch & batch, llama_token id, int pos, bool logits) {
-    batch.token[batch.n_tokens] = id;
-    batch.pos[batch.n_tokens]   = pos;
-    batch.n_seq_id[batch.n_tokens] = 1;
-    batch.seq_id[batch.n_tokens][0] = 0;
-    batch.logits[batch.n_tokens] = logits;
-    batch.n_tokens++;
+/* ----------------- CACHÉ DE CADENAS DE SAMPLERS ----------------- */
+static void sampler_key_from_state(const LlamaState *state, SamplerKey *key) {
+    memset(key, 0, sizeof(*key));
+    key->temp              = state->temp;
+    key->top_p             = state->top_p;
+    key->min_p             = state->min_p;
+    key->repeat_penalty    = state->repeat_penalty;
+    key->presence_penalty  = state->presence_penalty;
+    key->frequency_penalty = state->frequency_penalty;
+    key->mirostat_tau      = state->mirostat_tau;
+    key->mirostat_eta      = state->mirostat_eta;
+    key->top_k             = state->top_k;
+    key->repeat_last_n     = state->repeat_last_n;
+    key->mirostat          = state->mirostat;
+    key->seed              = state->seed;
+    key->grammar           = state->grammar ? state->grammar->id : 0;
+    key->bias              = state->bias ? state->bias->id : 0;
 }
 
-/* ----------------- UTF-8 VALIDATION HELPERS ----------------- */
-static int utf8_char_length(unsigned char first_byte) {
-    // Determinar cuántos bytes tiene un carácter UTF-8 basado en el primer byte
-    if ((first_byte & 0x80) == 0x00) return 1;      // 0xxxxxxx - ASCII
-    if ((first_byte & 0xE0) == 0xC0) return 2;      // 110xxxxx - 2 bytes
-    if ((first_byte & 0xF0) == 0xE0) return 3;      // 1110xxxx - 3 bytes
-    if ((first_byte & 0xF8) == 0xF0) return 4;      // 11110xxx - 4 bytes
-    return 1; // Inválido, tratar como 1 byte
+static void sampler_key_to_state(const SamplerKey *key, LlamaState *state) {
+    state->temp              = key->temp;
+    state->top_p             = key->top_p;
+    state->min_p             = key->min_p;
+    state->repeat_penalty    = key->repeat_penalty;
+    state->presence_penalty  = key->presence_penalty;
+    state->frequency_penalty = key->frequency_penalty;
+    state->mirostat_tau      = key->mirostat_tau;
+    state->mirostat_eta      = key->mirostat_eta;
+    state->top_k             = key->top_k;
+    state->repeat_last_n     = key->repeat_last_n;
+    state->mirostat          = key->mirostat;
+    state->seed              = key->seed;
 }
 
-static size_t find_last_utf8_boundary(const std::string& str, size_t max_pos) {
-    // Encontrar la posición del último carácter UTF-8 completo antes de max_pos
-    if (max_pos >= str.length()) {
-        max_pos = str.length();
-    }
+// Deja en state->sampler la cadena de los parámetros actuales. Si ya existe se
+// reinicia (mismo resultado que reconstruirla); si no, se construye y reemplaza
+// a la entrada menos usada.
+static void select_sampler(LlamaState *state) {
+    SamplerKey key;
+    sampler_key_from_state(state, &key);
+    state->sampler_tick++;
     
-    size_t pos = 0;
-    size_t last_valid = 0;
-    
-    while (pos < max_pos) {
-        int char_len = utf8_char_length((unsigned char)str[pos]);
-        
-        if (pos + char_len <= max_pos) {
-            // Este carácter cabe completo
-            last_valid = pos + char_len;
-            pos += char_len;
-        } else {
-            // Este carácter se cortaría, detener
-            break;
+    SamplerCacheEntry *victim = NULL;
+    for (int i = 0; i < SAMPLER_CACHE_SIZE; i++) {
+        SamplerCacheEntry *e = &state->sampler_cache[i];
+        if (e->chain && memcmp(&e->key, &key, sizeof(key)) == 0) {
+            llama_sampler_reset(e->chain);
+            e->last_use = state->sampler_tick;
+            state->sampler = e->chain;
+            state->n_sampler_hits++;
+            return;
+        }
+        if (!victim || (victim->chain && (!e->chain || e->last_use < victim->last_use))) {
+            victim = e;
         }
     }
     
-    return last_valid;
+    if (victim->chain) llama_sampler_free(victim->chain);
+    victim->key = key;
+    victim->chain = build_sampler_chain(state);
+    victim->last_use = state->sampler_tick;
+    state->sampler = victim->chain;
+    state->n_sampler_builds++;
 }
 
-/* ----------------- CORE GENERATION LOOP (v7.5 - Universal + Buffer) ----------------- */
-static int run_inference(Tcl_Interp *interp, LlamaState *state, const char *cb_name, 
-                        std::vector<llama_token> & stop_ids) {
-    Tcl_DString resp;
-    Tcl_DStringInit(&resp);
-    
-    // Buffer para detectar tags textuales (caso Gemma)
-    std::string text_buffer;
-    const size_t BUFFER_SIZE = 50;
-    
-    auto t_start_gen = std::chrono::high_resolution_clock::now();
-    
-    int max_tokens = (state->n_predict > 0) ? state->n_predict : 4096;
-    int p_cnt = 0;
+static void sampler_cache_free(LlamaState *state) {
+    for (int i = 0; i < SAMPLER_CACHE_SIZE; i++) {
+        if (state->sampler_cache[i].chain) llama_sampler_free(state->sampler_cache[i].chain);
+        state->sampler_cache[i].chain = NULL;
+    }
+    state->sampler = NULL;
+}
+
+/* ----------------- JSON SCHEMA -> GBNF ----------------- */
+// Subconjunto práctico de JSON Schema: type (o lista de tipos), properties,
+// required, items, minItems, enum, const, anyOf/oneOf. $ref y los demás
+// combinadores se rechazan; las demás restricciones (pattern, format,
+// longitudes, rangos) se ignoran.
+
+struct JsonValue {
+    enum Type { J_NULL, J_BOOL, J_NUMBER, J_STRING, J_ARRAY, J_OBJECT } type;
+    std::string str;            // Texto de la cadena, o literal de número/booleano
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue> > members;
     
-    while (p_cnt < max_tokens) {
-        if (state->n_past >= state->n_ctx) break;
-        
-        llama_token id = llama_sampler_sample(state->sampler, state->ctx, -1);
-        llama_sampler_accept(state->sampler, id);
-        
-        // DEBUG: Si verbose está activado, mostrar info del token
-        if (state->verbose) {
-            enum llama_token_attr attr = llama_vocab_get_attr(state->vocab, id);
-            char debug_piece[64];
-            int debug_n = llama_token_to_piece(state->vocab, id, debug_piece, 63, 0, false);
-            if (debug_n > 0) debug_piece[debug_n] = 0;
-            else debug_piece[0] = 0;
-            
-            fprintf(stderr, "[Ik'nal DEBUG] token=%d, attr=%d, piece='%s', is_eog=%d, is_control=%d\n",
-                    id, attr, debug_piece, 
-                    llama_vocab_is_eog(state->vocab, id),
-                    (attr & LLAMA_TOKEN_ATTR_CONTROL) ? 1 : 0);
+    JsonValue() : type(J_NULL) {}
+    const JsonValue *get(const char *key) const {
+        for (size_t i = 0; i < members.size(); i++) {
+            if (members[i].first == key) return &members[i].second;
         }
-        
-        // --- ESCUDO NIVEL 1: TOKENS OFICIALES DE CONTROL ---
-        
-        // 1a. EOG nativo (funciona para la mayoría)
-        if (llama_vocab_is_eog(state->vocab, id)) break;
-        
-        // 1b. Token marcado como CONTROL (Llama3, Mistral, Qwen bien configurados)
-        if (llama_vocab_get_attr(state->vocab, id) & LLAMA_TOKEN_ATTR_CONTROL) break;
-        
-        // --- ESCUDO NIVEL 2: STOP IDS MANUALES ---
-        bool s_stop = false;
-        for (auto s : stop_ids) {
-            if (id == s) {
-                s_stop = true;
-                break;
-            }
+        return NULL;
+    }
+};
+
+static void json_skip_ws(const char *&p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+}
+
+static void utf8_append(std::string &out, unsigned cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+static bool json_parse_hex4(const char *&p, const char *end, unsigned *cp) {
+    if (end - p < 4) return false;
+    *cp = 0;
+    for (int i = 0; i < 4; i++, p++) {
+        char c = *p;
+        *cp <<= 4;
+        if (c >= '0' && c <= '9') *cp |= c - '0';
+        else if (c >= 'a' && c <= 'f') *cp |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') *cp |= c - 'A' + 10;
+        else return false;
+    }
+    return true;
+}
+
+static bool json_parse_string(const char *&p, const char *end, std::string &out) {
+    if (p >= end || *p != '"') return false;
+    p++;
+    while (p < end && *p != '"') {
+        if ((unsigned char)*p < 0x20) return false;
+        if (*p != '\\') {
+            out += *p++;
+            continue;
         }
-        if (s_stop) break;
-        
-        char piece[512];
-        int n = llama_token_to_piece(state->vocab, id, piece, sizeof(piece) - 1, 0, false);
-        
-        if (n > 0 && n < (int)sizeof(piece)) {
-            piece[n] = 0;
-            
-            // Agregar al buffer de texto
-            text_buffer.append(piece, n);
-            
-            // Mantener buffer limitado
-            if (text_buffer.length() > BUFFER_SIZE) {
-                text_buffer = text_buffer.substr(text_buffer.length() - BUFFER_SIZE);
-            }
-            
-            // --- ESCUDO NIVEL 3: DETECCIÓN TEXTUAL (caso Gemma) ---
-            // Buscar tags generados como texto fragmentado
-            bool found_tag = false;
-            
-            if (text_buffer.find("<end_of_turn>") != std::string::npos ||
-                text_buffer.find("<start_of_turn>") != std::string::npos ||
-                text_buffer.find("<|im_end|>") != std::string::npos ||
-                text_buffer.find("<|eot_id|>") != std::string::npos ||
-                text_buffer.find("<|endoftext|>") != std::string::npos) {
-                found_tag = true;
-            }
-            
-            if (found_tag) {
-                // Encontramos un tag en el texto
-                // Necesitamos remover el tag del output
-                
-                // Calcular cuánto del buffer es el tag
-                size_t tag_pos = std::string::npos;
-                std::string found_tag_str;
-                
-                const char* tags[] = {
-                    "<end_of_turn>", "<start_of_turn>", 
-                    "<|im_end|>", "<|eot_id|>", "<|endoftext|>", NULL
-                };
-                
-                for (int i = 0; tags[i] != NULL; i++) {
-                    size_t pos = text_buffer.find(tags[i]);
-                    if (pos != std::string::npos) {
-                        tag_pos = pos;
-                        found_tag_str = tags[i];
-                        break;
-                    }
-                }
-                
-                if (tag_pos != std::string::npos) {
-                    // Extraer solo lo que va antes del tag
-                    std::string before_tag = text_buffer.substr(0, tag_pos);
-                    
-                    if (!before_tag.empty()) {
-                        // Asegurar UTF-8 válido
-                        size_t safe_len = find_last_utf8_boundary(before_tag, before_tag.length());
-                        if (safe_len > 0) {
-                            Tcl_DStringAppend(&resp, before_tag.c_str(), safe_len);
-                            
-                            if (cb_name) {
-                                Tcl_Obj *cmd = Tcl_NewListObj(0, NULL);
-                                Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(cb_name, -1));
-                                Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(before_tag.c_str(), safe_len));
-                                Tcl_EvalObjEx(interp, cmd, TCL_EVAL_DIRECT);
-                            }
-                        }
-                    }
+        if (++p >= end) return false;
+        char e = *p++;
+        switch (e) {
+            case '"': case '\\': case '/': out += e; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned cp, lo;
+                if (!json_parse_hex4(p, end, &cp)) return false;
+                if (cp >= 0xD800 && cp < 0xDC00) {
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u') return false;
+                    p += 2;
+                    if (!json_parse_hex4(p, end, &lo) || lo < 0xDC00 || lo > 0xDFFF) return false;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
                 }
+                utf8_append(out, cp);
                 break;
             }
-            
-            // Enviar caracteres de forma segura (UTF-8)
-            if (text_buffer.length() > 20) {
-                size_t safe_len = text_buffer.length() - 20;
-                safe_len = find_last_utf8_boundary(text_buffer, safe_len);
-                
-                if (safe_len > 0) {
-                    std::string safe_part = text_buffer.substr(0, safe_len);
-                    
-                    Tcl_DStringAppend(&resp, safe_part.c_str(), safe_part.length());
-                    
-                    if (cb_name) {
-                        Tcl_Obj *cmd = Tcl_NewListObj(0, NULL);
-                        Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(cb_name, -1));
-                        Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(safe_part.c_str(), -1));
-                        
-                        if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_DIRECT) != TCL_OK) {
-                            Tcl_DStringFree(&resp);
-                            return TCL_ERROR;
-                        }
-                    }
-                    
-                    text_buffer = text_buffer.substr(safe_len);
-                }
-            }
-        }
-        
-        struct llama_batch b = llama_batch_init(1, 0, 1);
-        fill_batch(b, id, state->n_past, true);
-        state->n_past++;
-        
-        if (llama_decode(state->ctx, b) != 0) {
-            llama_batch_free(b);
-            Tcl_DStringFree(&resp);
-            Tcl_SetObjResult(interp, Tcl_NewStringObj("Decode failed during generation", -1));
-            return TCL_ERROR;
+            default: return false;
         }
-        llama_batch_free(b);
-        p_cnt++;
     }
+    if (p >= end) return false;
+    p++;
+    return true;
+}
+
+static bool json_parse_value(const char *&p, const char *end, JsonValue &v, int depth) {
+    if (depth > 64) return false;
+    json_skip_ws(p, end);
+    if (p >= end) return false;
     
-    // Al terminar, enviar lo que quedó en el buffer (sin tags)
-    if (!text_buffer.empty()) {
-        // Verificar que no haya tags parciales al final
-        bool has_partial_tag = false;
-        const char* partial_tags[] = {"<end", "<start", "<|im", "<|eot", NULL};
-        
-        for (int i = 0; partial_tags[i] != NULL; i++) {
-            if (text_buffer.find(partial_tags[i]) != std::string::npos) {
-                has_partial_tag = true;
-                break;
-            }
+    if (*p == '{') {
+        v.type = JsonValue::J_OBJECT;
+        p++;
+        json_skip_ws(p, end);
+        if (p < end && *p == '}') { p++; return true; }
+        for (;;) {
+            std::pair<std::string, JsonValue> m;
+            json_skip_ws(p, end);
+            if (!json_parse_string(p, end, m.first)) return false;
+            json_skip_ws(p, end);
+            if (p >= end || *p++ != ':') return false;
+            if (!json_parse_value(p, end, m.second, depth + 1)) return false;
+            v.members.push_back(m);
+            json_skip_ws(p, end);
+            if (p < end && *p == ',') { p++; continue; }
+            if (p < end && *p == '}') { p++; return true; }
+            return false;
         }
-        
-        if (!has_partial_tag) {
-            Tcl_DStringAppend(&resp, text_buffer.c_str(), text_buffer.length());
-            
-            if (cb_name) {
-                Tcl_Obj *cmd = Tcl_NewListObj(0, NULL);
-                Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(cb_name, -1));
-                Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(text_buffer.c_str(), -1));
-                Tcl_EvalObjEx(interp, cmd, TCL_EVAL_DIRECT);
-            }
+    }
+    if (*p == '[') {
+        v.type = JsonValue::J_ARRAY;
+        p++;
+        json_skip_ws(p, end);
+        if (p < end && *p == ']') { p++; return true; }
+        for (;;) {
+            v.items.push_back(JsonValue());
+            if (!json_parse_value(p, end, v.items.back(), depth + 1)) return false;
+            json_skip_ws(p, end);
+            if (p < end && *p == ',') { p++; continue; }
+            if (p < end && *p == ']') { p++; return true; }
+            return false;
         }
     }
+    if (*p == '"') {
+        v.type = JsonValue::J_STRING;
+        return json_parse_string(p, end, v.str);
+    }
     
-    auto t_end_gen = std::chrono::high_resolution_clock::now();
-    state->t_gen_ms = std::chrono::duration<double, std::milli>(t_end_gen - t_start_gen).count();
-    state->n_gen = p_cnt;
+    static const char *words[] = { "true", "false", "null" };
+    for (int i = 0; i < 3; i++) {
+        size_t n = strlen(words[i]);
+        if ((size_t)(end - p) >= n && memcmp(p, words[i], n) == 0) {
+            v.type = (i < 2) ? JsonValue::J_BOOL : JsonValue::J_NULL;
+            v.str = words[i];
+            p += n;
+            return true;
+        }
+    }
     
-    Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&resp), -1));
-    Tcl_DStringFree(&resp);
-    return TCL_OK;
+    const char *start = p;
+    if (p < end && *p == '-') p++;
+    while (p < end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-')) p++;
+    if (p == start) return false;
+    v.type = JsonValue::J_NUMBER;
+    v.str.assign(start, p - start);
+    return true;
 }
 
-/* ----------------- LLAMA::GENERATE (Stateful) ----------------- */
-static int Llama_Generate_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
-    if (objc < 3) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::generate handle prompt ?-callback proc? ?-options dict? ?-reset bool? ?-stop_ids list? ?-system string? ?-max_tokens int?", -1));
-        return TCL_ERROR;
+// Serialización compacta: forma exacta que el modelo debe emitir para enum/const
+static void json_dump(const JsonValue &v, std::string &out) {
+    switch (v.type) {
+        case JsonValue::J_STRING:
+            out += '"';
+            for (size_t i = 0; i < v.str.size(); i++) {
+                unsigned char c = v.str[i];
+                if (c == '"' || c == '\\') { out += '\\'; out += (char)c; }
+                else if (c == '\n') out += "\\n";
+                else if (c == '\r') out += "\\r";
+                else if (c == '\t') out += "\\t";
+                else if (c < 0x20) { char buf[8]; snprintf(buf, sizeof(buf), "\\u%04x", c); out += buf; }
+                else out += (char)c;
+            }
+            out += '"';
+            break;
+        case JsonValue::J_ARRAY:
+            out += '[';
+            for (size_t i = 0; i < v.items.size(); i++) {
+                if (i) out += ',';
+                json_dump(v.items[i], out);
+            }
+            out += ']';
+            break;
+        case JsonValue::J_OBJECT:
+            out += '{';
+            for (size_t i = 0; i < v.members.size(); i++) {
+                JsonValue key;
+                key.type = JsonValue::J_STRING;
+                key.str = v.members[i].first;
+                if (i) out += ',';
+                json_dump(key, out);
+                out += ':';
+                json_dump(v.members[i].second, out);
+            }
+            out += '}';
+            break;
+        default:
+            out += v.str;
     }
-    
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
-        return TCL_ERROR;
+}
+
+// Literal GBNF entre comillas
+static std::string gbnf_literal(const std::string &text) {
+    std::string out = "\"";
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if (c == '\n') out += "\\n";
+        else if (c == '\r') out += "\\r";
+        else if (c == '\t') out += "\\t";
+        else out += c;
     }
-    LlamaState *state = (LlamaState*)info.objClientData;
+    return out + "\"";
+}
 
-    const char *prompt = Tcl_GetString(objv[2]);
-    char *cb_name = NULL;
-    char *system_msg = NULL;
-    int reset = 0;
-    std::vector<llama_token> stop_ids;
+// Reglas de JSON genérico; las del esquema se apoyan en ellas
+static const char *json_gbnf_base = R"GBNF(
+value ::= object | array | string | number | boolean | null
+object ::= "{" ws ( string ":" ws value ( "," ws string ":" ws value )* )? "}" ws
+array ::= "[" ws ( value ( "," ws value )* )? "]" ws
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" ( ["\\/bfnrt] | "u" [0-9a-fA-F]{4} ) )* "\"" ws
+number ::= "-"? ( [0-9] | [1-9] [0-9]{0,15} ) ( "." [0-9]+ )? ( [eE] [-+]? [0-9]{1,15} )? ws
+integer ::= "-"? ( [0-9] | [1-9] [0-9]{0,15} ) ws
+boolean ::= ( "true" | "false" ) ws
+null ::= "null" ws
+ws ::= | " " | "\n" [ \t]{0,20}
+)GBNF";
 
-    for (int i = 3; i < objc; i += 2) {
-        if (i + 1 >= objc) break;
-        const char *opt = Tcl_GetString(objv[i]);
-        if (strcmp(opt, "-callback") == 0) cb_name = Tcl_GetString(objv[i+1]);
-        if (strcmp(opt, "-options") == 0) apply_options(interp, objv[i+1], state);
-        if (strcmp(opt, "-reset") == 0) Tcl_GetBooleanFromObj(interp, objv[i+1], &reset);
-        if (strcmp(opt, "-system") == 0) system_msg = Tcl_GetString(objv[i+1]);
-        if (strcmp(opt, "-max_tokens") == 0) {
-            int max_tokens;
-            if (Tcl_GetIntFromObj(interp, objv[i+1], &max_tokens) == TCL_OK) {
-                state->n_predict = max_tokens;
-            }
+typedef struct {
+    std::string rules;
+    int         n_rules;
+    std::string error;
+} SchemaConverter;
+
+static std::string schema_rule(SchemaConverter *sc, const std::string &body) {
+    char name[32];
+    snprintf(name, sizeof(name), "r%d", ++sc->n_rules);
+    sc->rules += std::string(name) + " ::= " + body + "\n";
+    return name;
+}
+
+static std::string schema_visit(SchemaConverter *sc, const JsonValue &schema, int depth);
+
+static std::string schema_alternatives(SchemaConverter *sc, const JsonValue &list, int depth) {
+    std::string body;
+    for (size_t i = 0; i < list.items.size(); i++) {
+        if (i) body += " | ";
+        body += schema_visit(sc, list.items[i], depth + 1);
+    }
+    return list.items.empty() ? "value" : schema_rule(sc, body);
+}
+
+static std::string schema_object(SchemaConverter *sc, const JsonValue &schema, int depth) {
+    const JsonValue *props = schema.get("properties");
+    if (!props || props->type != JsonValue::J_OBJECT || props->members.empty()) return "object";
+    
+    std::vector<std::string> required, optional;
+    const JsonValue *req = schema.get("required");
+    for (size_t i = 0; i < props->members.size(); i++) {
+        const std::string &name = props->members[i].first;
+        JsonValue key;
+        key.type = JsonValue::J_STRING;
+        key.str = name;
+        std::string lit;
+        json_dump(key, lit);
+        std::string kv = gbnf_literal(lit) + " ws \":\" ws " + schema_visit(sc, props->members[i].second, depth + 1);
+        
+        bool is_req = false;
+        for (size_t r = 0; req && req->type == JsonValue::J_ARRAY && r < req->items.size(); r++) {
+            if (req->items[r].type == JsonValue::J_STRING && req->items[r].str == name) is_req = true;
         }
-        if (strcmp(opt, "-stop_ids") == 0) {
-            int se; Tcl_Obj **sel;
-            if (Tcl_ListObjGetElements(interp, objv[i+1], &se, &sel) == TCL_OK) {
-                for (int k=0; k<se; k++) {
-                    int id;
-                    if (Tcl_GetIntFromObj(interp, sel[k], &id) == TCL_OK) {
-                        stop_ids.push_back(id);
-                    }
-                }
-            }
+        (is_req ? required : optional).push_back(kv);
+    }
+    
+    // Obligatorias en el orden declarado y luego las opcionales; sin
+    // obligatorias, cualquier subconjunto de las opcionales
+    std::string body = "\"{\" ws ";
+    if (!required.empty()) {
+        for (size_t i = 0; i < required.size(); i++) {
+            if (i) body += " \",\" ws ";
+            body += required[i];
         }
+        for (size_t i = 0; i < optional.size(); i++) {
+            body += " ( \",\" ws " + optional[i] + " )?";
+        }
+    } else {
+        std::string alt;
+        for (size_t i = 0; i < optional.size(); i++) {
+            if (i) alt += " | ";
+            alt += optional[i];
+        }
+        alt = schema_rule(sc, alt);
+        body += "( " + alt + " ( \",\" ws " + alt + " )* )?";
+    }
+    return schema_rule(sc, body + " \"}\" ws");
+}
+
+static std::string schema_type(SchemaConverter *sc, const JsonValue &schema, const std::string &type, int depth) {
+    if (type == "object") return schema_object(sc, schema, depth);
+    if (type == "array") {
+        const JsonValue *items = schema.get("items");
+        const JsonValue *min_items = schema.get("minItems");
+        std::string item = items ? schema_visit(sc, *items, depth + 1) : "value";
+        std::string list = item + " ( \",\" ws " + item + " )*";
+        bool non_empty = min_items && min_items->type == JsonValue::J_NUMBER && atof(min_items->str.c_str()) >= 1;
+        return schema_rule(sc, "\"[\" ws " + (non_empty ? list : "( " + list + " )?") + " \"]\" ws");
     }
+    if (type == "string" || type == "number" || type == "integer" ||
+        type == "boolean" || type == "null") {
+        return type;
+    }
+    sc->error = "Unsupported schema type \"" + type + "\"";
+    return "value";
+}
 
-    if (reset) {
-        state->n_past = 0;
-        llama_kv_self_clear(state->ctx);
+static std::string schema_visit(SchemaConverter *sc, const JsonValue &schema, int depth) {
+    if (depth > 32) {
+        sc->error = "Schema nested too deeply";
+        return "value";
+    }
+    if (schema.type == JsonValue::J_BOOL && schema.str == "true") return "value";
+    if (schema.type != JsonValue::J_OBJECT) {
+        sc->error = "Schema must be an object";
+        return "value";
+    }
+    if (schema.get("$ref") || schema.get("allOf") || schema.get("not")) {
+        sc->error = "Unsupported schema keyword ($ref, allOf, not)";
+        return "value";
     }
     
-    // Construir prompt con system message si existe
-    std::string full_prompt;
-    if (system_msg && strlen(system_msg) > 0 && state->n_past == 0) {
-        full_prompt = std::string(system_msg) + "\n\n" + std::string(prompt);
-    } else {
-        full_prompt = std::string(prompt);
+    const JsonValue *v;
+    if ((v = schema.get("const")) != NULL) {
+        std::string lit;
+        json_dump(*v, lit);
+        return schema_rule(sc, gbnf_literal(lit) + " ws");
+    }
+    if ((v = schema.get("enum")) != NULL && v->type == JsonValue::J_ARRAY && !v->items.empty()) {
+        std::string body = "(";
+        for (size_t i = 0; i < v->items.size(); i++) {
+            std::string lit;
+            json_dump(v->items[i], lit);
+            body += (i ? " | " : " ") + gbnf_literal(lit);
+        }
+        return schema_rule(sc, body + " ) ws");
+    }
+    if ((v = schema.get("anyOf")) != NULL || (v = schema.get("oneOf")) != NULL) {
+        if (v->type != JsonValue::J_ARRAY) {
+            sc->error = "anyOf/oneOf must be an array";
+            return "value";
+        }
+        return schema_alternatives(sc, *v, depth);
     }
     
-    std::vector<llama_token> tokens(full_prompt.length() + 256);
-    int n_tok = llama_tokenize(state->vocab, full_prompt.c_str(), full_prompt.length(), 
-                                tokens.data(), tokens.size(), (state->n_past == 0), false);
+    const JsonValue *type = schema.get("type");
+    if (!type) {
+        return schema.get("properties") ? schema_object(sc, schema, depth) : "value";
+    }
+    if (type->type == JsonValue::J_STRING) return schema_type(sc, schema, type->str, depth);
+    if (type->type == JsonValue::J_ARRAY && !type->items.empty()) {
+        std::string body;
+        for (size_t i = 0; i < type->items.size(); i++) {
+            if (i) body += " | ";
+            body += schema_type(sc, schema, type->items[i].str, depth);
+        }
+        return schema_rule(sc, body);
+    }
+    sc->error = "Invalid schema \"type\"";
+    return "value";
+}
+
+// Convierte el esquema en gramática GBNF con regla "root". Devuelve false y
+// deja el motivo en 'error' si el JSON o el esquema no son válidos.
+static bool json_schema_to_gbnf(const char *text, size_t len, std::string &gbnf, std::string &error) {
+    const char *p = text, *end = text + len;
+    JsonValue schema;
+    if (!json_parse_value(p, end, schema, 0)) {
+        error = "Invalid JSON in schema";
+        return false;
+    }
+    json_skip_ws(p, end);
+    if (p != end) {
+        error = "Invalid JSON in schema";
+        return false;
+    }
     
-    if (n_tok < 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Tokenization failed", -1));
-        return TCL_ERROR;
+    SchemaConverter sc;
+    sc.n_rules = 0;
+    std::string root = schema_visit(&sc, schema, 0);
+    if (!sc.error.empty()) {
+        error = sc.error;
+        return false;
     }
+    gbnf = "root ::= " + root + "\n" + sc.rules + json_gbnf_base;
+    return true;
+}
 
-    // Verificar overflow de contexto
-    if (state->n_past + n_tok >= state->n_ctx) {
-        char msg[256];
-        snprintf(msg, sizeof(msg), "Context overflow: n_past=%d + n_tok=%d >= n_ctx=%d", 
-                 state->n_past, n_tok, state->n_ctx);
-        Tcl_SetObjResult(interp, Tcl_NewStringObj(msg, -1));
-        return TCL_ERROR;
+/* ----------------- CACHÉ DE ETAPAS (GRAMÁTICA / LOGIT BIAS) ----------------- */
+static StageEntry *stage_find(LlamaState *state, const std::string &key) {
+    state->sampler_tick++;
+    auto it = state->stages->find(key);
+    if (it == state->stages->end()) return NULL;
+    it->second.last_use = state->sampler_tick;
+    return &it->second;
+}
+
+static StageEntry *stage_insert(LlamaState *state, const std::string &key, struct llama_sampler *proto) {
+    // Expulsar la menos usada (nunca una de las activas en el handle)
+    if (state->stages->size() >= STAGE_CACHE_SIZE) {
+        auto victim = state->stages->end();
+        for (auto g = state->stages->begin(); g != state->stages->end(); ++g) {
+            if (&g->second == state->grammar || &g->second == state->bias) continue;
+            if (victim == state->stages->end() || g->second.last_use < victim->second.last_use) victim = g;
+        }
+        if (victim != state->stages->end()) {
+            llama_sampler_free(victim->second.proto);
+            state->stages->erase(victim);
+        }
     }
+    
+    StageEntry &e = (*state->stages)[key];
+    e.id = ++state->stage_next_id;
+    e.proto = proto;
+    e.last_use = state->sampler_tick;
+    return &e;
+}
 
-    // Telemetría: medir tiempo de ingestión del prompt
-    auto t_start_eval = std::chrono::high_resolution_clock::now();
+// -grammar gbnf / -json_schema schema: busca la gramática compilada del
+// handle o la compila (y convierte el esquema) una sola vez
+static int grammar_lookup(Tcl_Interp *interp, LlamaState *state, Tcl_Obj *src, int is_schema,
+                          StageEntry **out) {
+    int len;
+    const char *text = Tcl_GetStringFromObj(src, &len);
+    std::string key = std::string(is_schema ? "json:" : "gbnf:") + std::string(text, len);
     
-    struct llama_batch batch = llama_batch_init(n_tok, 0, 1);
-    for (int i = 0; i < n_tok; i++) {
-        fill_batch(batch, tokens[i], state->n_past, (i == n_tok - 1));
-        state->n_past++;
+    if ((*out = stage_find(state, key)) != NULL) {
+        state->n_grammar_hits++;
+        return TCL_OK;
+    }
+    
+    std::string gbnf, error;
+    if (is_schema) {
+        if (!json_schema_to_gbnf(text, len, gbnf, error)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid JSON schema: %s", error.c_str()));
+            return TCL_ERROR;
+        }
+        if (state->verbose) fprintf(stderr, "[Ik'nal DEBUG] JSON schema grammar:\n%s", gbnf.c_str());
+    } else {
+        gbnf.assign(text, len);
     }
     
-    if (llama_decode(state->ctx, batch) != 0) {
-        llama_batch_free(batch);
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Decode failed", -1));
+    struct llama_sampler *proto = llama_sampler_init_grammar(state->vocab, gbnf.c_str(), "root");
+    if (!proto) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(is_schema ? "Failed to compile grammar for JSON schema" : "Invalid grammar", -1));
         return TCL_ERROR;
     }
-    llama_batch_free(batch);
+    state->n_grammar_compiles++;
+    *out = stage_insert(state, key, proto);
+    return TCL_OK;
+}
+
+// Token único al que tokeniza text, o -1 si hacen falta varios
+static llama_token single_token(LlamaState *state, const std::string & text) {
+    llama_token toks[2];
+    int n_tok = llama_tokenize(state->vocab, text.c_str(), (int32_t)text.length(), toks, 2, false, false);
+    return (n_tok == 1) ? toks[0] : -1;
+}
+
+// -logit_bias {token bias ...} / -ban_strings {str ...}: vector disperso de
+// bias. Cada cadena prohibida debe ser un solo token, tal cual o con espacio
+// inicial (" word" es la forma habitual dentro del texto); se prohíben las
+// variantes que lo sean. Prohibir cada token de una frase vetaría también sus
+// palabras sueltas en cualquier otro contexto: las frases van por -stop o una
+// gramática. La clave es el contenido de ambas opciones: repetirlas no vuelve
+// a tokenizar.
+static int bias_lookup(Tcl_Interp *interp, LlamaState *state, Tcl_Obj *bias_obj, Tcl_Obj *ban_obj,
+                       StageEntry **out) {
+    std::string key = "bias:";
+    if (bias_obj) key += Tcl_GetString(bias_obj);
+    key += '\0';
+    if (ban_obj) key += Tcl_GetString(ban_obj);
     
-    auto t_end_eval = std::chrono::high_resolution_clock::now();
-    state->t_eval_ms = std::chrono::duration<double, std::milli>(t_end_eval - t_start_eval).count();
-    state->n_eval = n_tok;
+    if ((*out = stage_find(state, key)) != NULL) {
+        state->n_bias_hits++;
+        return TCL_OK;
+    }
+    
+    int n_vocab = llama_vocab_n_tokens(state->vocab);
+    std::map<llama_token, float> bias;
+    
+    if (bias_obj) {
+        int n;
+        Tcl_Obj **elems;
+        if (Tcl_ListObjGetElements(interp, bias_obj, &n, &elems) != TCL_OK) return TCL_ERROR;
+        if (n % 2 != 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("-logit_bias expects a list of token bias pairs", -1));
+            return TCL_ERROR;
+        }
+        for (int i = 0; i < n; i += 2) {
+            int id;
+            double b;
+            if (Tcl_GetIntFromObj(interp, elems[i], &id) != TCL_OK ||
+                Tcl_GetDoubleFromObj(interp, elems[i+1], &b) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (id < 0 || id >= n_vocab) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Token %d out of range (n_vocab %d)", id, n_vocab));
+                return TCL_ERROR;
+            }
+            bias[id] = (float)b;
+        }
+    }
+    
+    if (ban_obj) {
+        int n;
+        Tcl_Obj **elems;
+        if (Tcl_ListObjGetElements(interp, ban_obj, &n, &elems) != TCL_OK) return TCL_ERROR;
+        for (int i = 0; i < n; i++) {
+            int len;
+            const char *text = Tcl_GetStringFromObj(elems[i], &len);
+            if (len == 0) continue;
+            std::string plain(text, len);
+            llama_token id = single_token(state, plain);
+            llama_token id_sp = (text[0] != ' ') ? single_token(state, " " + plain) : -1;
+            if (id < 0 && id_sp < 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("-ban_strings: \"%s\" is not a single token (use -stop or a grammar for phrases)", text));
+                return TCL_ERROR;
+            }
+            if (id >= 0) bias[id] = -INFINITY;
+            if (id_sp >= 0) bias[id_sp] = -INFINITY;
+        }
+    }
+    
+    std::vector<llama_logit_bias> sparse;
+    sparse.reserve(bias.size());
+    for (auto it = bias.begin(); it != bias.end(); ++it) {
+        llama_logit_bias lb;
+        lb.token = it->first;
+        lb.bias = it->second;
+        sparse.push_back(lb);
+    }
+    
+    struct llama_sampler *proto = llama_sampler_init_logit_bias(n_vocab, (int32_t)sparse.size(), sparse.data());
+    state->n_bias_compiles++;
+    *out = stage_insert(state, key, proto);
+    return TCL_OK;
+}
 
-    return run_inference(interp, state, cb_name, stop_ids);
+// Activa las etapas de la petición (o ninguna) y reinicia la cadena: la
+// gramática tiene estado y cada respuesta empieza desde la regla raíz
+static void use_stages(LlamaState *state, StageEntry *grammar, StageEntry *bias) {
+    if (!grammar && !bias && !state->grammar && !state->bias) return;
+    state->grammar = grammar;
+    state->bias = bias;
+    select_sampler(state);
 }
 
-/* ----------------- LLAMA::CHAT (Stateless) ----------------- */
-static int Llama_Chat(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
-    if (objc < 3) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::chat handle messages ?-callback proc? ?-options dict? ?-stop_ids list? ?-max_tokens int?", -1));
-        return TCL_ERROR;
+static void stage_cache_free(LlamaState *state) {
+    if (!state->stages) return;
+    for (auto it = state->stages->begin(); it != state->stages->end(); ++it) {
+        llama_sampler_free(it->second.proto);
     }
+    delete state->stages;
+    state->stages = NULL;
+    state->grammar = NULL;
+    state->bias = NULL;
+}
+
+/* ----------------- MODULADOR DE OPCIONES (APPLY_OPTIONS) ----------------- */
+// Claves aceptadas en -options, resueltas en una sola pasada sobre el dict
+typedef struct {
+    const char *name;
+    int         is_float;
+    size_t      offset;     // Dentro de SamplerProfile
+} SamplerOptionDef;
+
+static const SamplerOptionDef sampler_option_defs[] = {
+    { "temperature",    1, offsetof(SamplerProfile, key.temp) },
+    { "top_k",          0, offsetof(SamplerProfile, key.top_k) },
+    { "top_p",          1, offsetof(SamplerProfile, key.top_p) },
+    { "min_p",          1, offsetof(SamplerProfile, key.min_p) },
+    { "repeat_penalty", 1, offsetof(SamplerProfile, key.repeat_penalty) },
+    { "repeat_last_n",  0, offsetof(SamplerProfile, key.repeat_last_n) },
+    { "num_predict",    0, offsetof(SamplerProfile, n_predict) },
+    { "mirostat",       0, offsetof(SamplerProfile, key.mirostat) },
+    { "mirostat_tau",   1, offsetof(SamplerProfile, key.mirostat_tau) },
+    { "mirostat_eta",   1, offsetof(SamplerProfile, key.mirostat_eta) },
+    { "seed",           0, offsetof(SamplerProfile, key.seed) },
+    { NULL, 0, 0 }
+};
+
+// Superpone las claves del dict sobre 'prof'. Las claves desconocidas se
+// ignoran; un valor inválido deja el error en el intérprete y devuelve TCL_ERROR.
+static int parse_sampler_options(Tcl_Interp *interp, Tcl_Obj *options_obj, SamplerProfile *prof) {
+    Tcl_DictSearch search;
+    Tcl_Obj *key, *val;
+    int done;
+    int rc = TCL_OK;
     
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
+    if (Tcl_DictObjFirst(interp, options_obj, &search, &key, &val, &done) != TCL_OK) {
         return TCL_ERROR;
     }
-    LlamaState *state = (LlamaState*)info.objClientData;
+    for (; !done; Tcl_DictObjNext(&search, &key, &val, &done)) {
+        const char *name = Tcl_GetString(key);
+        for (const SamplerOptionDef *def = sampler_option_defs; def->name; def++) {
+            if (strcmp(name, def->name) != 0) continue;
+            char *target = (char*)prof + def->offset;
+            if (def->is_float) {
+                double d;
+                if (Tcl_GetDoubleFromObj(interp, val, &d) == TCL_OK) *(float*)target = (float)d;
+                else rc = TCL_ERROR;
+            } else {
+                int i;
+                if (Tcl_GetIntFromObj(interp, val, &i) == TCL_OK) *(int32_t*)target = (int32_t)i;
+                else rc = TCL_ERROR;
+            }
+            break;
+        }
+    }
+    Tcl_DictObjDone(&search);
+    
+    // Validación de rangos con clamping (v6.9)
+    SamplerKey *k = &prof->key;
+    if (k->temp < 0.0f) k->temp = 0.0f;
+    if (k->temp > 2.0f) k->temp = 2.0f;
+    
+    if (k->top_k < 1) k->top_k = 1;
+    
+    if (k->top_p < 0.0f) k->top_p = 0.0f;
+    if (k->top_p > 1.0f) k->top_p = 1.0f;
+    
+    if (k->min_p < 0.0f) k->min_p = 0.0f;
+    if (k->min_p > 1.0f) k->min_p = 1.0f;
+    
+    if (k->repeat_penalty < 0.0f) k->repeat_penalty = 1.0f;
+    
+    if (prof->n_predict < -1) prof->n_predict = -1;
+    return rc;
+}
 
-    // CHAT ES STATELESS: RESET SIEMPRE
-    state->n_past = 0;
-    llama_kv_self_clear(state->ctx);
+static void apply_options(Tcl_Interp *interp, Tcl_Obj *options_obj, LlamaState *state) {
+    if (options_obj) {
+        SamplerProfile prof;
+        sampler_key_from_state(state, &prof.key);
+        prof.n_predict = state->n_predict;
+        parse_sampler_options(interp, options_obj, &prof);
+        sampler_key_to_state(&prof.key, state);
+        state->n_predict = prof.n_predict;
+    }
+    select_sampler(state);
+}
 
-    int n_msgs;
-    Tcl_Obj **msgs_elems;
-    if (Tcl_ListObjGetElements(interp, objv[2], &n_msgs, &msgs_elems) != TCL_OK) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid messages list", -1));
+// -profile name: carga un perfil definido con llama::profile
+static int apply_profile(Tcl_Interp *interp, Tcl_Obj *name_obj, LlamaState *state) {
+    auto it = state->profiles->find(Tcl_GetString(name_obj));
+    if (it == state->profiles->end()) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown sampling profile \"%s\"", Tcl_GetString(name_obj)));
         return TCL_ERROR;
     }
+    sampler_key_to_state(&it->second.key, state);
+    state->n_predict = it->second.n_predict;
+    select_sampler(state);
+    return TCL_OK;
+}
+
+static void fill_batch(struct llama_batch & batch, llama_token id, int pos, bool logits,
+                       llama_seq_id seq_id = 0) {
+    batch.token[batch.n_tokens] = id;
+    batch.pos[batch.n_tokens]   = pos;
+    batch.n_seq_id[batch.n_tokens] = 1;
+    batch.seq_id[batch.n_tokens][0] = seq_id;
+    batch.logits[batch.n_tokens] = logits;
+    batch.n_tokens++;
+}
+
+/* ----------------- UTF-8 VALIDATION HELPERS ----------------- */
+static int utf8_char_length(unsigned char first_byte) {
+    // Determinar cuántos bytes tiene un carácter UTF-8 basado en el primer byte
+    if ((first_byte & 0x80) == 0x00) return 1;      // 0xxxxxxx - ASCII
+    if ((first_byte & 0xE0) == 0xC0) return 2;      // 110xxxxx - 2 bytes
+    if ((first_byte & 0xF0) == 0xE0) return 3;      // 1110xxxx - 3 bytes
+    if ((first_byte & 0xF8) == 0xF0) return 4;      // 11110xxx - 4 bytes
+    return 1; // Inválido, tratar como 1 byte
+}
+
+static size_t find_last_utf8_boundary(const char *str, size_t len, size_t max_pos) {
+    // Encontrar la posición del último carácter UTF-8 completo antes de max_pos
+    if (max_pos >= len) {
+        max_pos = len;
+    }
     
-    std::vector<llama_chat_message> cmsgs;
-    std::vector<char*> allocated_strings;
+    size_t pos = 0;
+    size_t last_valid = 0;
     
-    for (int i = 0; i < n_msgs; i++) {
-        Tcl_Obj *v_role, *v_content;
-        Tcl_Obj *role_key = Tcl_NewStringObj("role", -1);
-        Tcl_Obj *content_key = Tcl_NewStringObj("content", -1);
-        
-        Tcl_IncrRefCount(role_key);
-        Tcl_IncrRefCount(content_key);
-        
-        Tcl_DictObjGet(interp, msgs_elems[i], role_key, &v_role);
-        Tcl_DictObjGet(interp, msgs_elems[i], content_key, &v_content);
-        
-        Tcl_DecrRefCount(role_key);
-        Tcl_DecrRefCount(content_key);
+    while (pos < max_pos) {
+        int char_len = utf8_char_length((unsigned char)str[pos]);
         
-        if (v_role && v_content) {
-            char* role_str = strdup(Tcl_GetString(v_role));
-            char* content_str = strdup(Tcl_GetString(v_content));
-            
-            if (!role_str || !content_str) {
-                // Cleanup on allocation failure
-                for (auto ptr : allocated_strings) free(ptr);
-                free(role_str);
-                free(content_str);
-                Tcl_SetObjResult(interp, Tcl_NewStringObj("Memory allocation failed", -1));
-                return TCL_ERROR;
-            }
-            
-            allocated_strings.push_back(role_str);
-            allocated_strings.push_back(content_str);
-            cmsgs.push_back({role_str, content_str});
+        if (pos + char_len <= max_pos) {
+            // Este carácter cabe completo
+            last_valid = pos + char_len;
+            pos += char_len;
+        } else {
+            // Este carácter se cortaría, detener
+            break;
         }
     }
+    
+    return last_valid;
+}
 
-    char *cb_name = NULL;
-    std::vector<llama_token> stop_ids;
+/* ----------------- DETECTOR DE STOP STRINGS (Aho-Corasick) ----------------- */
+// Autómata sobre los tags de control textuales más los -stop del usuario. Es un
+// DFA completo: una consulta a tabla por byte, sin retroceder. La profundidad
+// del estado actual es justo la cantidad de bytes que pueden ser inicio de un
+// stop, que es lo único que el stream necesita retener.
+
+#define STOP_STRING_MAX 256     // Longitud máxima de cada -stop
+
+static const char *builtin_stop_tags[] = {
+    "<end_of_turn>", "<start_of_turn>",
+    "<|im_end|>", "<|eot_id|>", "<|endoftext|>", NULL
+};
+
+struct StopMatcher {
+    uint16_t      cls[256];             // Byte -> clase (0 = no aparece en ningún patrón; hasta 257 clases)
+    int           n_classes;
+    std::vector<int> delta;             // Transiciones [estado * n_classes + clase]
+    std::vector<int> depth;             // Longitud del prefijo que representa el estado
+    std::vector<int> match_len;         // Patrón más largo que termina aquí (0 = ninguno)
+    std::vector<unsigned char> builtin; // El estado es prefijo de un tag de control
+};
+
+static StopMatcher *stop_matcher_build(const std::vector<std::string> &user) {
+    std::vector<std::string> pats;
+    for (int i = 0; builtin_stop_tags[i]; i++) pats.push_back(builtin_stop_tags[i]);
+    size_t n_builtin = pats.size();
+    for (auto &u : user) {
+        if (!u.empty()) pats.push_back(u);
+    }
     
-    for (int i = 3; i < objc; i += 2) {
-        if (i + 1 >= objc) break;
-        const char *opt = Tcl_GetString(objv[i]);
-        if (strcmp(opt, "-callback") == 0) cb_name = Tcl_GetString(objv[i+1]);
-        if (strcmp(opt, "-options") == 0) apply_options(interp, objv[i+1], state);
-        if (strcmp(opt, "-max_tokens") == 0) {
-            int max_tokens;
-            if (Tcl_GetIntFromObj(interp, objv[i+1], &max_tokens) == TCL_OK) {
-                state->n_predict = max_tokens;
-            }
+    StopMatcher *m = new StopMatcher();
+    memset(m->cls, 0, sizeof(m->cls));
+    m->n_classes = 1;
+    for (auto &p : pats) {
+        for (unsigned char c : p) {
+            if (!m->cls[c]) m->cls[c] = (uint16_t)m->n_classes++;
         }
-        if (strcmp(opt, "-stop_ids") == 0) {
-            int se; Tcl_Obj **sel;
-            if (Tcl_ListObjGetElements(interp, objv[i+1], &se, &sel) == TCL_OK) {
-                for (int k=0; k<se; k++) {
-                    int id;
-                    if (Tcl_GetIntFromObj(interp, sel[k], &id) == TCL_OK) {
-                        stop_ids.push_back(id);
-                    }
-                }
+    }
+    const int nc = m->n_classes;
+    
+    // Trie
+    std::vector<int> term(1, 0);
+    m->delta.assign(nc, -1);
+    m->depth.assign(1, 0);
+    m->builtin.assign(1, 0);
+    for (size_t p = 0; p < pats.size(); p++) {
+        int st = 0;
+        for (unsigned char c : pats[p]) {
+            int &next = m->delta[st * nc + m->cls[c]];
+            if (next < 0) {
+                int id = (int)m->depth.size();
+                next = id;  // Antes de crecer 'delta' (invalida la referencia)
+                m->delta.resize((id + 1) * nc, -1);
+                m->depth.push_back(m->depth[st] + 1);
+                m->builtin.push_back(0);
+                term.push_back(0);
             }
+            st = m->delta[st * nc + m->cls[c]];
+            if (p < n_builtin) m->builtin[st] = 1;
         }
+        term[st] = (int)pats[p].size();
     }
-
-    // Obtener template del modelo con buffer dinámico
-    char tmpl_buffer[256];
-    int tmpl_ret = llama_model_meta_val_str(state->model, "tokenizer.chat_template", 
-                                             tmpl_buffer, sizeof(tmpl_buffer));
     
-    std::string tmpl;
-    if (tmpl_ret > 0 && tmpl_ret < (int)sizeof(tmpl_buffer)) {
-        tmpl = std::string(tmpl_buffer);
-    } else if (tmpl_ret > (int)sizeof(tmpl_buffer)) {
-        // Template es más grande, usar buffer dinámico
-        std::vector<char> large_buffer(tmpl_ret + 1);
-        llama_model_meta_val_str(state->model, "tokenizer.chat_template", 
-                                  large_buffer.data(), large_buffer.size());
-        tmpl = std::string(large_buffer.data());
-    } else {
-        // Sin template, usar fallback simple
-        tmpl = "{% for message in messages %}{{ message.role }}: {{ message.content }}\n{% endfor %}";
+    // Enlaces de falla en BFS y cierre de transiciones faltantes
+    int n_states = (int)m->depth.size();
+    std::vector<int> fail(n_states, 0), order;
+    order.reserve(n_states);
+    m->match_len.assign(n_states, 0);
+    for (int c = 0; c < nc; c++) {
+        int v = m->delta[c];
+        if (v < 0) m->delta[c] = 0;
+        else { fail[v] = 0; order.push_back(v); }
+    }
+    for (size_t q = 0; q < order.size(); q++) {
+        int u = order[q];
+        m->match_len[u] = term[u] ? term[u] : m->match_len[fail[u]];
+        for (int c = 0; c < nc; c++) {
+            int v = m->delta[u * nc + c];
+            int f = m->delta[fail[u] * nc + c];
+            if (v < 0) m->delta[u * nc + c] = f;
+            else { fail[v] = f; order.push_back(v); }
+        }
     }
+    return m;
+}
 
-    int32_t fmt_len = llama_chat_apply_template(tmpl.c_str(), cmsgs.data(), cmsgs.size(), 
-                                                  true, NULL, 0);
+// Autómata compartido para el caso sin -stop (sólo tags de control)
+static const StopMatcher *default_stop_matcher() {
+    static const StopMatcher *m = stop_matcher_build(std::vector<std::string>());
+    return m;
+}
+
+// -stop {str ...}: lista de strings que cortan la generación
+static int parse_stop_strings(Tcl_Interp *interp, Tcl_Obj *list_obj, std::vector<std::string> &stops) {
+    int n; Tcl_Obj **elems;
+    if (Tcl_ListObjGetElements(interp, list_obj, &n, &elems) != TCL_OK) return TCL_ERROR;
+    for (int k = 0; k < n; k++) {
+        int len;
+        const char *str = Tcl_GetStringFromObj(elems[k], &len);
+        if (len > STOP_STRING_MAX) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Stop string too long (max %d bytes)", STOP_STRING_MAX));
+            return TCL_ERROR;
+        }
+        if (len > 0) stops.push_back(std::string(str, len));
+    }
+    return TCL_OK;
+}
+
+/* ----------------- FLUJO DE TEXTO (stop strings + UTF-8) ----------------- */
+// Estado de salida de una generación: respuesta acumulada, bytes retenidos
+// mientras puedan ser inicio de un stop (caso Gemma: tags emitidos como texto)
+// y callback de streaming. Todo lo que usa el bucle por token se reserva una
+// vez en stream_init.
+struct AsyncRequest;
+static void async_queue_piece(struct AsyncRequest *req, const char *text, int len, int n_tok, int n_total);
+
+#define STREAM_HOLD_MAX     1024    // Stop más largo + fragmento máximo (512) con margen
+#define STREAM_RESP_PREALLOC 4096
+
+// Opciones de streaming comunes a generate, chat y batch submit
+typedef struct {
+    Tcl_Obj *cmd;          // -callback: prefijo de comando (lista); NULL = sin streaming
+    int      flush_ms;     // -flush_ms: agrupar fragmentos durante este intervalo
+    int      flush_bytes;  // -flush_bytes: agrupar fragmentos hasta este tamaño
+    int      counts;       // -counts: pasar {tokens total} como argumento extra
+    Tcl_Channel chan;      // -channel: escribir los fragmentos directo al canal
+    int      chan_flush;   // -channel_flush: Tcl_Flush tras cada escritura
+} StreamOpts;
+
+static void stream_opts_init(StreamOpts *so) {
+    so->cmd = NULL;
+    so->flush_ms = 0;
+    so->flush_bytes = 0;
+    so->counts = 0;
+    so->chan = NULL;
+    so->chan_flush = 1;
+}
+
+// Aplica opt si es una opción de streaming; cualquier otra se ignora con TCL_OK
+static int stream_opts_parse(Tcl_Interp *interp, const char *opt, Tcl_Obj *val, StreamOpts *so) {
+    if (strcmp(opt, "-callback") == 0) {
+        int n;
+        if (Tcl_ListObjLength(interp, val, &n) != TCL_OK) return TCL_ERROR;
+        so->cmd = (n > 0) ? val : NULL;
+    } else if (strcmp(opt, "-flush_ms") == 0) {
+        if (Tcl_GetIntFromObj(interp, val, &so->flush_ms) != TCL_OK) return TCL_ERROR;
+        if (so->flush_ms < 0) so->flush_ms = 0;
+    } else if (strcmp(opt, "-flush_bytes") == 0) {
+        if (Tcl_GetIntFromObj(interp, val, &so->flush_bytes) != TCL_OK) return TCL_ERROR;
+        if (so->flush_bytes < 0) so->flush_bytes = 0;
+    } else if (strcmp(opt, "-counts") == 0) {
+        if (Tcl_GetBooleanFromObj(interp, val, &so->counts) != TCL_OK) return TCL_ERROR;
+    } else if (strcmp(opt, "-channel") == 0) {
+        int mode;
+        Tcl_Channel chan = Tcl_GetChannel(interp, Tcl_GetString(val), &mode);
+        if (chan == NULL) return TCL_ERROR;
+        if (!(mode & TCL_WRITABLE)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("channel \"%s\" wasn't opened for writing", Tcl_GetString(val)));
+            return TCL_ERROR;
+        }
+        so->chan = chan;
+    } else if (strcmp(opt, "-channel_flush") == 0) {
+        if (Tcl_GetBooleanFromObj(interp, val, &so->chan_flush) != TCL_OK) return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+typedef struct {
+    Tcl_DString  resp;
+    char         text_buffer[STREAM_HOLD_MAX];  // Bytes aún no emitidos
+    int          text_len;
+    const struct StopMatcher *matcher;
+    struct StopMatcher *own_matcher;            // Autómata propio si hubo -stop
+    int          ac_state;
+    
+    // Comando del callback: prefijo, argumento extra opcional, fragmento y
+    // conteos; se arma una vez por petición y se reutiliza en cada invocación
+    Tcl_Obj    **cb_objv;
+    int          cb_objc;
+    int          cb_piece;     // Índice del fragmento en cb_objv
+    int          cb_counts;    // Índice de {tokens total} en cb_objv (-1 = sin -counts)
+    
+    // -channel: registrado en stream_init para que no se cierre con la petición viva
+    Tcl_Channel  chan;
+    int          chan_flush;
+    LatencyHist *cb_hist;      // Tiempo de canal + callback (NULL = no medir)
+    
+    // Agrupación (-flush_ms / -flush_bytes): texto aún no entregado al callback
+    Tcl_DString  pending;
+    int          flush_ms;
+    int          flush_bytes;
+    std::chrono::steady_clock::time_point t_flush;
+    int          n_tok_pending;  // Tokens cuyo texto va en el próximo envío
+    int          n_tok_total;
+    
+    struct AsyncRequest *async;  // Si no es NULL, los fragmentos se encolan al hilo dueño
+} TextStream;
+
+enum { STREAM_CONTINUE = 0, STREAM_STOP = 1, STREAM_ERROR = 2 };
+
+// cb_arg: argumento extra antes del fragmento (p.ej. id de petición), puede ser NULL.
+// Con -async se llama igual desde el hilo dueño: el hilo de trabajo nunca toca cb_objv.
+static void stream_init(TextStream *ts, const StreamOpts *so, Tcl_Obj *cb_arg) {
+    Tcl_DStringInit(&ts->resp);
+    Tcl_DStringSetLength(&ts->resp, STREAM_RESP_PREALLOC);
+    Tcl_DStringSetLength(&ts->resp, 0);
+    ts->text_len = 0;
+    ts->matcher = default_stop_matcher();
+    ts->own_matcher = NULL;
+    ts->ac_state = 0;
+    ts->cb_objv = NULL;
+    ts->cb_objc = 0;
+    ts->cb_piece = -1;
+    ts->cb_counts = -1;
+    ts->chan = NULL;
+    ts->chan_flush = 0;
+    ts->cb_hist = NULL;
+    Tcl_DStringInit(&ts->pending);
+    ts->flush_ms = 0;
+    ts->flush_bytes = 0;
+    ts->t_flush = std::chrono::steady_clock::now();
+    ts->n_tok_pending = 0;
+    ts->n_tok_total = 0;
+    ts->async = NULL;
+    
+    if (cb_arg) Tcl_IncrRefCount(cb_arg);
+    if (so && so->cmd) {
+        // El prefijo ya se validó como lista en stream_opts_parse
+        int n_words;
+        Tcl_Obj **words;
+        Tcl_ListObjGetElements(NULL, so->cmd, &n_words, &words);
+        ts->cb_objv = (Tcl_Obj**)ckalloc(sizeof(Tcl_Obj*) * (n_words + 3));
+        for (int i = 0; i < n_words; i++) ts->cb_objv[ts->cb_objc++] = words[i];
+        if (cb_arg) ts->cb_objv[ts->cb_objc++] = cb_arg;
+        
+        // Objeto del fragmento con capacidad suficiente para cualquier emisión
+        Tcl_Obj *piece = Tcl_NewObj();
+        Tcl_SetObjLength(piece, STREAM_HOLD_MAX);
+        Tcl_SetObjLength(piece, 0);
+        ts->cb_piece = ts->cb_objc;
+        ts->cb_objv[ts->cb_objc++] = piece;
+        
+        if (so->counts) {
+            Tcl_Obj *pair[2] = { Tcl_NewIntObj(0), Tcl_NewIntObj(0) };
+            ts->cb_counts = ts->cb_objc;
+            ts->cb_objv[ts->cb_objc++] = Tcl_NewListObj(2, pair);
+        }
+        for (int i = 0; i < ts->cb_objc; i++) Tcl_IncrRefCount(ts->cb_objv[i]);
+    }
+    // Sin callback el argumento no se usa, pero el llamador cede la referencia
+    if (cb_arg) Tcl_DecrRefCount(cb_arg);
+    
+    if (so && so->chan) {
+        Tcl_RegisterChannel(NULL, so->chan);
+        ts->chan = so->chan;
+        ts->chan_flush = so->chan_flush;
+    }
+    
+    if (so && (so->flush_ms > 0 || so->flush_bytes > 0)) {
+        ts->flush_ms = so->flush_ms;
+        ts->flush_bytes = so->flush_bytes;
+        if (so->flush_bytes > 0) {
+            Tcl_DStringSetLength(&ts->pending, so->flush_bytes + STREAM_HOLD_MAX);
+            Tcl_DStringSetLength(&ts->pending, 0);
+        }
+    }
+}
+
+// Agrega los -stop del usuario a los tags de control
+static void stream_set_stops(TextStream *ts, const std::vector<std::string> &stops) {
+    if (stops.empty()) return;
+    delete ts->own_matcher;
+    ts->own_matcher = stop_matcher_build(stops);
+    ts->matcher = ts->own_matcher;
+    ts->ac_state = 0;
+}
+
+static void stream_free(TextStream *ts) {
+    Tcl_DStringFree(&ts->resp);
+    Tcl_DStringFree(&ts->pending);
+    for (int i = 0; i < ts->cb_objc; i++) Tcl_DecrRefCount(ts->cb_objv[i]);
+    if (ts->cb_objv) ckfree((char*)ts->cb_objv);
+    ts->cb_objv = NULL;
+    ts->cb_objc = 0;
+    if (ts->chan) Tcl_UnregisterChannel(NULL, ts->chan);
+    ts->chan = NULL;
+    delete ts->own_matcher;
+    ts->own_matcher = NULL;
+}
+
+// Objeto sin compartir en cb_objv[k]: si el script se quedó con el anterior, uno nuevo
+static Tcl_Obj *stream_slot(TextStream *ts, int k) {
+    Tcl_Obj *obj = ts->cb_objv[k];
+    if (Tcl_IsShared(obj)) {
+        Tcl_DecrRefCount(obj);
+        obj = Tcl_NewObj();
+        Tcl_IncrRefCount(obj);
+        ts->cb_objv[k] = obj;
+        HOT_ALLOC();
+    }
+    return obj;
+}
+
+// Invoca el callback con un fragmento ya agrupado. n_tok: tokens cuyo texto
+// trae el fragmento; n_total: tokens entregados desde el inicio de la petición.
+static int stream_invoke(Tcl_Interp *interp, TextStream *ts, const char *text, int len,
+                         int n_tok, int n_total, int flags) {
+    Tcl_Obj *piece = stream_slot(ts, ts->cb_piece);
+    // Con la misma longitud Tcl_SetObjLength no hace nada y conservaría la
+    // representación interna del fragmento anterior (lista, número, índices de
+    // caracteres); pasar por 0 la descarta sin soltar el buffer.
+    Tcl_SetObjLength(piece, 0);
+    Tcl_SetObjLength(piece, len);
+    memcpy(Tcl_GetString(piece), text, len);
+    
+    if (ts->cb_counts >= 0) {
+        // Actualizar el par en sitio salvo que el script retenga la lista o sus elementos
+        Tcl_Obj *counts = ts->cb_objv[ts->cb_counts];
+        int n;
+        Tcl_Obj **elems;
+        if (Tcl_IsShared(counts) || Tcl_ListObjGetElements(NULL, counts, &n, &elems) != TCL_OK ||
+            n != 2 || Tcl_IsShared(elems[0]) || Tcl_IsShared(elems[1])) {
+            counts = stream_slot(ts, ts->cb_counts);
+            Tcl_Obj *pair[2] = { Tcl_NewIntObj(n_tok), Tcl_NewIntObj(n_total) };
+            Tcl_SetListObj(counts, 2, pair);
+        } else {
+            Tcl_SetIntObj(elems[0], n_tok);
+            Tcl_SetIntObj(elems[1], n_total);
+            Tcl_InvalidateStringRep(counts);
+        }
+    }
+    return Tcl_EvalObjv(interp, ts->cb_objc, ts->cb_objv, flags);
+}
+
+// Salida de un fragmento en el hilo dueño: primero el canal, luego el callback.
+// El texto llega siempre cortado en frontera UTF-8, así que Tcl_WriteChars
+// nunca ve un carácter partido.
+static int stream_send(Tcl_Interp *interp, TextStream *ts, const char *text, int len,
+                       int n_tok, int n_total, int flags) {
+    if (ts->chan) {
+        if (Tcl_WriteChars(ts->chan, text, len) < 0 ||
+            (ts->chan_flush && Tcl_Flush(ts->chan) != TCL_OK)) {
+            if (interp) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\": %s",
+                                 Tcl_GetChannelName(ts->chan), Tcl_PosixError(interp)));
+            }
+            return TCL_ERROR;
+        }
+    }
+    if (ts->cb_objc > 0) return stream_invoke(interp, ts, text, len, n_tok, n_total, flags);
+    return TCL_OK;
+}
+
+// stream_send midiendo canal + callback en cb_hist
+static int stream_output(Tcl_Interp *interp, TextStream *ts, const char *text, int len,
+                         int n_tok, int n_total, int flags) {
+    if ((!ts->cb_hist && !trace_enabled()) || (!ts->chan && ts->cb_objc == 0)) {
+        return stream_send(interp, ts, text, len, n_tok, n_total, flags);
+    }
+    LatTime t0 = lat_now();
+    int rc = stream_send(interp, ts, text, len, n_tok, n_total, flags);
+    LatTime t1 = lat_now();
+    if (ts->cb_hist) lat_span(ts->cb_hist, t0, t1);
+    trace_emit("callback", t0, t1, len);
+    return rc;
+}
+
+// Entrega el texto al callback/canal (o al hilo dueño con -async) sin agrupar
+static int stream_deliver(Tcl_Interp *interp, TextStream *ts, const char *text, int len) {
+    int n_tok = ts->n_tok_pending;
+    ts->n_tok_pending = 0;
+    if (ts->async) {
+        async_queue_piece(ts->async, text, len, n_tok, ts->n_tok_total);
+        return TCL_OK;
+    }
+    return stream_output(interp, ts, text, len, n_tok, ts->n_tok_total, 0);
+}
+
+// Envía lo agrupado pendiente
+static int stream_flush(Tcl_Interp *interp, TextStream *ts) {
+    int len = Tcl_DStringLength(&ts->pending);
+    if (len == 0) return TCL_OK;
+    ts->t_flush = std::chrono::steady_clock::now();
+    int rc = stream_deliver(interp, ts, Tcl_DStringValue(&ts->pending), len);
+    Tcl_DStringSetLength(&ts->pending, 0);
+    return rc;
+}
+
+// Agrega texto a la respuesta y lo envía al callback si existe. Con -flush_ms o
+// -flush_bytes se acumula hasta alcanzar cualquiera de los dos umbrales; el
+// plazo se revisa al llegar cada fragmento y lo que quede sale en stream_finish.
+static int stream_emit(Tcl_Interp *interp, TextStream *ts, const char *text, int len) {
+    int space_before = ts->resp.spaceAvl;
+    Tcl_DStringAppend(&ts->resp, text, len);
+    if (ts->resp.spaceAvl != space_before) HOT_ALLOC();
+    
+    // cb_objc y chan no cambian tras stream_init: leerlos desde el hilo de trabajo es seguro
+    if (ts->cb_objc == 0 && !ts->chan) return TCL_OK;
+    if (ts->flush_ms == 0 && ts->flush_bytes == 0) return stream_deliver(interp, ts, text, len);
+    
+    space_before = ts->pending.spaceAvl;
+    Tcl_DStringAppend(&ts->pending, text, len);
+    if (ts->pending.spaceAvl != space_before) HOT_ALLOC();
+    
+    if (ts->flush_bytes > 0 && Tcl_DStringLength(&ts->pending) >= ts->flush_bytes) {
+        return stream_flush(interp, ts);
+    }
+    if (ts->flush_ms > 0) {
+        double elapsed = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - ts->t_flush).count();
+        if (elapsed >= ts->flush_ms) return stream_flush(interp, ts);
+    }
+    return TCL_OK;
+}
+
+// Descarta los primeros n bytes retenidos (ya emitidos)
+static void stream_consume(TextStream *ts, int n) {
+    memmove(ts->text_buffer, ts->text_buffer + n, ts->text_len - n);
+    ts->text_len -= n;
+}
+
+// Procesa un fragmento recién generado. Devuelve STREAM_STOP si apareció un stop
+// (el texto previo ya fue emitido) o STREAM_ERROR si falló el callback.
+static int stream_push(Tcl_Interp *interp, TextStream *ts, const char *piece, int n) {
+    ts->n_tok_pending++;
+    ts->n_tok_total++;
+    
+    // Los stops miden <= STOP_STRING_MAX y n < 512, así que esto no debería pasar
+    if (ts->text_len + n > STREAM_HOLD_MAX) {
+        if (stream_emit(interp, ts, ts->text_buffer, ts->text_len) != TCL_OK) return STREAM_ERROR;
+        ts->text_len = 0;
+        ts->ac_state = 0;
+    }
+    int base = ts->text_len;
+    memcpy(ts->text_buffer + base, piece, n);
+    ts->text_len += n;
+    
+    LatTime t_match = trace_begin();
+    const StopMatcher *m = ts->matcher;
+    int st = ts->ac_state;
+    for (int j = base; j < ts->text_len; j++) {
+        st = m->delta[st * m->n_classes + m->cls[(unsigned char)ts->text_buffer[j]]];
+        if (m->match_len[st]) {
+            trace_end("stop_match", t_match);
+            // Emitir solo lo que va antes del stop, asegurando UTF-8 válido
+            int cut = j + 1 - m->match_len[st];
+            size_t safe_len = find_last_utf8_boundary(ts->text_buffer, cut, cut);
+            int rc = STREAM_STOP;
+            if (safe_len > 0 && stream_emit(interp, ts, ts->text_buffer, (int)safe_len) != TCL_OK) {
+                rc = STREAM_ERROR;
+            }
+            ts->text_len = 0;
+            ts->ac_state = 0;
+            return rc;
+        }
+    }
+    ts->ac_state = st;
+    trace_end("stop_match", t_match);
+    
+    // Retener sólo el prefijo vivo de algún stop; el resto sale ya (UTF-8 completo)
+    int emit = ts->text_len - m->depth[st];
+    if (emit > 0) {
+        size_t safe_len = find_last_utf8_boundary(ts->text_buffer, ts->text_len, emit);
+        if (safe_len > 0) {
+            if (stream_emit(interp, ts, ts->text_buffer, (int)safe_len) != TCL_OK) {
+                return STREAM_ERROR;
+            }
+            stream_consume(ts, (int)safe_len);
+        }
+    }
+    return STREAM_CONTINUE;
+}
+
+// Al terminar, enviar lo retenido salvo un tag de control truncado, y lo agrupado.
+// Un error del callback/canal aquí falla la petición igual que a mitad de camino.
+static int stream_finish(Tcl_Interp *interp, TextStream *ts) {
+    if (ts->text_len > 0) {
+        int held = ts->matcher->depth[ts->ac_state];
+        if (held >= 4 && ts->matcher->builtin[ts->ac_state]) {
+            ts->text_len -= held;
+        }
+        int rc = TCL_OK;
+        if (ts->text_len > 0) rc = stream_emit(interp, ts, ts->text_buffer, ts->text_len);
+        ts->text_len = 0;
+        ts->ac_state = 0;
+        if (rc != TCL_OK) return rc;
+    }
+    return stream_flush(interp, ts);
+}
+
+/* ----------------- TABLA DE PIEZAS DEL VOCABULARIO ----------------- */
+// Texto de cada token (sin especiales, igual que la salida de generación) en un
+// solo bloque contiguo con offsets, más los atributos que deciden el corte.
+// Se comparte entre todos los handles del mismo modelo y se construye en el
+// primer uso; una vez construida es de sólo lectura (segura para -async).
+
+enum { PIECE_EOG = 0x01, PIECE_CONTROL = 0x02 };
+
+struct PieceTable {
+    const struct llama_vocab *vocab;
+    int                    refs;
+    int                    built;
+    int                    n_vocab;
+    std::vector<char>      text;     // Piezas concatenadas
+    std::vector<uint32_t>  offset;   // n_vocab + 1 entradas
+    std::vector<unsigned char> flags;
+};
+
+TCL_DECLARE_MUTEX(piece_table_mutex)
+static std::map<const struct llama_vocab*, PieceTable*> *piece_tables = NULL;
+
+static PieceTable *piece_table_acquire(const struct llama_vocab *vocab) {
+    Tcl_MutexLock(&piece_table_mutex);
+    if (!piece_tables) piece_tables = new std::map<const struct llama_vocab*, PieceTable*>();
+    PieceTable *&pt = (*piece_tables)[vocab];
+    if (!pt) {
+        pt = new PieceTable();
+        pt->vocab = vocab;
+        pt->refs = 0;
+        pt->built = 0;
+        pt->n_vocab = 0;
+    }
+    pt->refs++;
+    Tcl_MutexUnlock(&piece_table_mutex);
+    return pt;
+}
+
+static void piece_table_release(PieceTable *pt) {
+    Tcl_MutexLock(&piece_table_mutex);
+    if (--pt->refs == 0) {
+        piece_tables->erase(pt->vocab);
+        delete pt;
+    }
+    Tcl_MutexUnlock(&piece_table_mutex);
+}
+
+// Construye la tabla si todavía no existe (llamar desde el hilo del comando,
+// antes de lanzar cualquier trabajo -async)
+static void piece_table_ensure(PieceTable *pt) {
+    Tcl_MutexLock(&piece_table_mutex);
+    if (!pt->built) {
+        int n_vocab = llama_vocab_n_tokens(pt->vocab);
+        pt->text.clear();
+        pt->text.reserve((size_t)n_vocab * 8);
+        pt->offset.resize(n_vocab + 1);
+        pt->flags.resize(n_vocab);
+        
+        std::vector<char> buf(512);
+        for (int id = 0; id < n_vocab; id++) {
+            int n = llama_token_to_piece(pt->vocab, id, buf.data(), (int32_t)buf.size(), 0, false);
+            if (n < 0) {
+                buf.resize(-n);
+                n = llama_token_to_piece(pt->vocab, id, buf.data(), (int32_t)buf.size(), 0, false);
+            }
+            pt->offset[id] = (uint32_t)pt->text.size();
+            if (n > 0) pt->text.insert(pt->text.end(), buf.data(), buf.data() + n);
+            
+            unsigned char f = 0;
+            if (llama_vocab_is_eog(pt->vocab, id)) f |= PIECE_EOG;
+            if (llama_vocab_get_attr(pt->vocab, id) & LLAMA_TOKEN_ATTR_CONTROL) f |= PIECE_CONTROL;
+            pt->flags[id] = f;
+        }
+        pt->offset[n_vocab] = (uint32_t)pt->text.size();
+        pt->n_vocab = n_vocab;
+        pt->built = 1;
+    }
+    Tcl_MutexUnlock(&piece_table_mutex);
+}
+
+// Texto del token 'id'; *len = 0 si no tiene representación o está fuera de rango
+static inline const char *piece_text(const PieceTable *pt, llama_token id, int *len) {
+    if (id < 0 || id >= pt->n_vocab) {
+        *len = 0;
+        return "";
+    }
+    *len = (int)(pt->offset[id + 1] - pt->offset[id]);
+    return pt->text.data() + pt->offset[id];
+}
+
+/* ----------------- ESCUDOS DE TOKEN (control / EOG / stop_ids) ----------------- */
+static bool is_stop_token(LlamaState *state, llama_token id, const std::vector<llama_token> & stop_ids) {
+    unsigned char flags = state->pieces->flags[id];
+    
+    // DEBUG: Si verbose está activado, mostrar info del token
+    if (state->verbose) {
+        int debug_n;
+        const char *debug_piece = piece_text(state->pieces, id, &debug_n);
+        fprintf(stderr, "[Ik'nal DEBUG] token=%d, attr=%d, piece='%.*s', is_eog=%d, is_control=%d\n",
+                id, llama_vocab_get_attr(state->vocab, id), debug_n, debug_piece,
+                (flags & PIECE_EOG) ? 1 : 0,
+                (flags & PIECE_CONTROL) ? 1 : 0);
+    }
+    
+    // --- ESCUDO NIVEL 1: TOKENS OFICIALES DE CONTROL ---
+    // 1a. EOG nativo (funciona para la mayoría)
+    // 1b. Token marcado como CONTROL (Llama3, Mistral, Qwen bien configurados)
+    if (flags & (PIECE_EOG | PIECE_CONTROL)) return true;
+    
+    // --- ESCUDO NIVEL 2: STOP IDS MANUALES ---
+    for (auto s : stop_ids) {
+        if (id == s) return true;
+    }
+    return false;
+}
+
+/* ----------------- CONTEXT SHIFT ----------------- */
+// Libera espacio en la secuencia 0 sin re-decodificar: conserva los primeros
+// n_keep tokens (p.ej. el system prompt), borra la mitad más antigua del resto
+// y desplaza las posiciones de lo que queda. Devuelve false si no se pudo.
+static bool context_shift(LlamaState *state) {
+    if (!state->ctx_shift || !llama_kv_self_can_shift(state->ctx)) return false;
+    
+    std::vector<llama_token> &kv = *state->kv_tokens;
+    int n_keep = state->n_keep;
+    if (n_keep < 1 && !kv.empty() && kv[0] == llama_vocab_bos(state->vocab)) n_keep = 1;
+    if (n_keep > state->n_past) n_keep = state->n_past;
+    
+    int n_discard = (state->n_past - n_keep) / 2;
+    if (n_discard <= 0) return false;
+    
+    if (!llama_kv_self_seq_rm(state->ctx, 0, n_keep, n_keep + n_discard)) return false;
+    llama_kv_self_seq_add(state->ctx, 0, n_keep + n_discard, state->n_past, -n_discard);
+    
+    kv.erase(kv.begin() + n_keep, kv.begin() + n_keep + n_discard);
+    state->n_past -= n_discard;
+    
+    state->n_ctx_shifts++;
+    state->n_ctx_shifts_total++;
+    state->n_ctx_discarded_total += n_discard;
+    if (state->verbose) {
+        fprintf(stderr, "[Ik'nal DEBUG] context shift: keep=%d discard=%d n_past=%d\n",
+                n_keep, n_discard, state->n_past);
+    }
+    return true;
+}
+
+/* ----------------- INGESTIÓN DEL PROMPT ----------------- */
+// Progreso de la ingestión: se invoca tras cada bloque de n_batch tokens. Un
+// valor distinto de 0 cancela (el KV vuelve al estado previo).
+typedef struct {
+    int  (*fn)(void *data, int n_done, int n_total);
+    void  *data;
+} IngestProgress;
+
+enum { INGEST_OK = 0, INGEST_FAILED, INGEST_CANCELLED };
+
+// Decodifica tokens[0..n_tok) en la secuencia 0 a partir de state->n_past en
+// bloques de n_batch, avanzando n_past. Sólo se piden logits del último token.
+static int decode_chunks(LlamaState *state, const llama_token *tokens, int n_tok,
+                         const IngestProgress *progress) {
+    int n_chunk = std::min(n_tok, (int)llama_n_batch(state->ctx));
+    int rc = INGEST_OK;
+    
+    struct llama_batch batch = llama_batch_init(std::max(n_chunk, 1), 0, 1);
+    for (int start = 0; start < n_tok; start += n_chunk) {
+        int end = std::min(start + n_chunk, n_tok);
+        batch.n_tokens = 0;
+        for (int i = start; i < end; i++) {
+            fill_batch(batch, tokens[i], state->n_past, (i == n_tok - 1));
+            state->n_past++;
+        }
+        if (llama_decode(state->ctx, batch) != 0) {
+            rc = INGEST_FAILED;
+            break;
+        }
+        if (progress && progress->fn(progress->data, end, n_tok) != 0) {
+            rc = INGEST_CANCELLED;
+            break;
+        }
+    }
+    llama_batch_free(batch);
+    return rc;
+}
+
+// Ingiere el prompt con decode_chunks y actualiza kv_tokens y la telemetría de
+// evaluación. Si falla o se cancela, revierte el KV al estado previo. No toca
+// el intérprete (se usa también desde hilos -async; el intérprete sólo vía 'progress').
+static int ingest_prompt(LlamaState *state, const llama_token *tokens, int n_tok,
+                         const IngestProgress *progress = NULL) {
+    // Telemetría: medir tiempo de ingestión del prompt
+    auto t_start_eval = std::chrono::high_resolution_clock::now();
+    state->t_request = lat_now();
+    state->lat_first = 1;
+    int n_past_before = state->n_past;
+    int rc = decode_chunks(state, tokens, n_tok, progress);
+    trace_end("prompt_decode", state->t_request, n_tok);
+    
+    if (rc != INGEST_OK) {
+        // Revertir al estado previo para conservar la conversación
+        state->n_past = n_past_before;
+        llama_kv_self_seq_rm(state->ctx, 0, n_past_before, -1);
+        return rc;
+    }
+    state->kv_tokens->insert(state->kv_tokens->end(), tokens, tokens + n_tok);
+    
+    auto t_end_eval = std::chrono::high_resolution_clock::now();
+    state->t_eval_ms = std::chrono::duration<double, std::milli>(t_end_eval - t_start_eval).count();
+    state->n_eval = n_tok;
+    state->n_reused = n_past_before;
+    state->n_eval_total += n_tok;
+    state->n_reused_total += n_past_before;
+    return INGEST_OK;
+}
+
+// -progress en modo síncrono: "cmd n_done n_total". break o error cancelan.
+typedef struct {
+    Tcl_Interp *interp;
+    Tcl_Obj    *cmd;
+    int         rc;
+} SyncProgress;
+
+static int sync_progress_fn(void *data, int n_done, int n_total) {
+    SyncProgress *sp = (SyncProgress*)data;
+    Tcl_Obj *objv[3];
+    objv[0] = sp->cmd;
+    objv[1] = Tcl_NewIntObj(n_done);
+    objv[2] = Tcl_NewIntObj(n_total);
+    Tcl_IncrRefCount(objv[1]);
+    Tcl_IncrRefCount(objv[2]);
+    sp->rc = Tcl_EvalObjv(sp->interp, 3, objv, 0);
+    Tcl_DecrRefCount(objv[1]);
+    Tcl_DecrRefCount(objv[2]);
+    return sp->rc != TCL_OK;
+}
+
+// Ingestión síncrona desde un comando: deja el error en el intérprete
+static int ingest_prompt_cmd(Tcl_Interp *interp, LlamaState *state, const llama_token *tokens,
+                             int n_tok, Tcl_Obj *progress_cmd) {
+    SyncProgress sp = { interp, progress_cmd, TCL_OK };
+    IngestProgress prog = { sync_progress_fn, &sp };
+    int rc = ingest_prompt(state, tokens, n_tok, progress_cmd ? &prog : NULL);
+    if (rc == INGEST_OK) return TCL_OK;
+    if (rc == INGEST_CANCELLED && sp.rc == TCL_ERROR) return TCL_ERROR;
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(rc == INGEST_CANCELLED ? "Prompt ingestion cancelled" : "Decode failed", -1));
+    return TCL_ERROR;
+}
+
+/* ----------------- CORE GENERATION LOOP (v7.5 - Universal + Buffer) ----------------- */
+// Muestrea y acepta el token de la fila idx de logits. Con GPU el decode es
+// asíncrono y la espera por sus resultados cae dentro del tiempo de sampling.
+static llama_token sample_next(LlamaState *state, int idx) {
+    LatTime t0 = lat_now();
+    llama_token id = llama_sampler_sample(state->sampler, state->ctx, idx);
+    llama_sampler_accept(state->sampler, id);
+    LatTime t1 = lat_now();
+    lat_span(&state->lat[LAT_SAMPLE], t0, t1);
+    trace_emit("sample", t0, t1, id);
+    return id;
+}
+
+// Entrega un token ya muestreado: escudos de stop y texto al stream. Devuelve
+// false si la generación termina aquí (rc = TCL_ERROR si falló el callback).
+static bool deliver_token(Tcl_Interp *interp, LlamaState *state, TextStream *ts, llama_token id,
+                          const std::vector<llama_token> & stop_ids, int *rc) {
+    if (is_stop_token(state, id, stop_ids)) return false;
+    
+    LatTime now = lat_now();
+    if (state->lat_first) {
+        lat_span(&state->lat[LAT_TTFT], state->t_request, now);
+        state->lat_first = 0;
+    } else {
+        lat_span(&state->lat[LAT_INTER_TOKEN], state->t_last_token, now);
+    }
+    state->t_last_token = now;
+    
+    LatTime t_detok = trace_begin();
+    int n;
+    const char *piece = piece_text(state->pieces, id, &n);
+    trace_end("detokenize", t_detok, n);
+    
+    if (n > 0 && n < 512) {
+        int sc = stream_push(interp, ts, piece, n);
+        if (sc == STREAM_STOP) return false;
+        if (sc == STREAM_ERROR) {
+            *rc = TCL_ERROR;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ----------------- DECODIFICACIÓN ESPECULATIVA ----------------- */
+// Un borrador propone varios tokens tras el último muestreado; el modelo
+// objetivo los verifica en un solo llama_decode y se acepta el prefijo que
+// coincide con lo que su propio sampler habría elegido. Lo rechazado se quita
+// del KV. El borrador es un segundo modelo (-draft) o, sin modelo extra, la
+// continuación del último n-grama dentro del propio historial (-lookup).
+
+#define SPEC_DRAFT_DEFAULT 8
+#define SPEC_DRAFT_MAX     32
+
+#define SPEC_NGRAM_MAX     8
+
+enum { SPEC_NONE = 0, SPEC_DRAFT, SPEC_LOOKUP };
+
+typedef struct {
+    LlamaState *draft;      // -draft: handle del modelo borrador (tiene prioridad sobre -lookup)
+    int         ngram;      // -lookup: tamaño del n-grama a buscar (0 = desactivado)
+    int         n_draft;    // -draft_n: tokens propuestos por paso
+} SpecParams;
+
+static void spec_params_init(SpecParams *spec) {
+    spec->draft = NULL;
+    spec->ngram = 0;
+    spec->n_draft = SPEC_DRAFT_DEFAULT;
+}
+
+static int spec_mode(const SpecParams *spec) {
+    if (!spec) return SPEC_NONE;
+    if (spec->draft) return SPEC_DRAFT;
+    if (spec->ngram > 0) return SPEC_LOOKUP;
+    return SPEC_NONE;
+}
+
+static int spec_active(const SpecParams *spec) {
+    return spec_mode(spec) != SPEC_NONE;
+}
+
+// -draft handle: valida que sea otro handle libre con vocabulario compatible
+static int parse_draft_handle(Tcl_Interp *interp, LlamaState *state, Tcl_Obj *obj, SpecParams *spec) {
+    LlamaState *draft = state_from_obj(interp, obj);
+    if (!draft) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid draft handle", -1));
+        return TCL_ERROR;
+    }
+    if (draft == state) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Draft handle must differ from the target handle", -1));
+        return TCL_ERROR;
+    }
+    if (check_idle(interp, draft) != TCL_OK) return TCL_ERROR;
+    if (llama_vocab_n_tokens(draft->vocab) != llama_vocab_n_tokens(state->vocab) ||
+        llama_vocab_bos(draft->vocab) != llama_vocab_bos(state->vocab) ||
+        llama_vocab_eos(draft->vocab) != llama_vocab_eos(state->vocab)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Draft model vocabulary is not compatible with the target model", -1));
+        return TCL_ERROR;
+    }
+    spec->draft = draft;
+    return TCL_OK;
+}
+
+static llama_token argmax_token(struct llama_context *ctx, int n_vocab) {
+    const float *logits = llama_get_logits_ith(ctx, -1);
+    llama_token best = 0;
+    for (llama_token t = 1; t < n_vocab; t++) {
+        if (logits[t] > logits[best]) best = t;
+    }
+    return best;
+}
+
+// Pone el KV del borrador al día con la secuencia del objetivo (kv_tokens + id)
+// y propone hasta n_want tokens greedy. 'db' es un batch de db_cap tokens.
+// Decodifica en crudo: la telemetría, latencias y traza del handle borrador no
+// registran trabajo que el usuario no pidió sobre él. Devuelve false si el
+// borrador no puede seguir (se desactiva la especulación).
+static bool draft_model_propose(LlamaState *state, LlamaState *draft, llama_token id, int n_want,
+                                struct llama_batch &db, int db_cap, std::vector<llama_token> &out) {
+    const std::vector<llama_token> &tk = *state->kv_tokens;
+    std::vector<llama_token> &dk = *draft->kv_tokens;
+    size_t n_t = tk.size() + 1;
+    
+    // Prefijo común; el último token siempre se decodifica para tener sus logits
+    size_t common = 0;
+    while (common < dk.size() && common < tk.size() && dk[common] == tk[common]) common++;
+    if (common == tk.size() && common < dk.size() && dk[common] == id) common++;
+    if (common >= n_t) common = n_t - 1;
+    
+    if (common < dk.size()) {
+        llama_kv_self_seq_rm(draft->ctx, 0, (llama_pos)common, -1);
+        dk.resize(common);
+        draft->n_past = (int)common;
+    }
+    if ((int)n_t + n_want >= draft->n_ctx) return false;
+    
+    // Atraso grande (primer paso: el prompt entero) en bloques de n_batch
+    if (n_t - common > (size_t)db_cap) {
+        if (decode_chunks(draft, tk.data() + common, (int)(tk.size() - common), NULL) != INGEST_OK) {
+            llama_kv_self_seq_rm(draft->ctx, 0, (llama_pos)common, -1);
+            draft->n_past = (int)common;
+            return false;
+        }
+        dk.insert(dk.end(), tk.begin() + common, tk.end());
+        common = tk.size();
+    }
+    db.n_tokens = 0;
+    for (size_t i = common; i < n_t; i++) {
+        fill_batch(db, (i < tk.size()) ? tk[i] : id, (int)i, i + 1 == n_t);
+    }
+    if (llama_decode(draft->ctx, db) != 0) {
+        llama_kv_self_seq_rm(draft->ctx, 0, (llama_pos)common, -1);
+        draft->n_past = (int)common;
+        return false;
+    }
+    for (size_t i = common; i < n_t; i++) dk.push_back((i < tk.size()) ? tk[i] : id);
+    draft->n_past = (int)n_t;
+    
+    int n_vocab = llama_vocab_n_tokens(draft->vocab);
+    struct llama_batch &b = draft->tok_batch;
+    for (int j = 0; j < n_want; j++) {
+        llama_token t = argmax_token(draft->ctx, n_vocab);
+        out.push_back(t);
+        if (j + 1 == n_want || (state->pieces->flags[t] & PIECE_EOG)) break;
+        
+        b.n_tokens = 0;
+        fill_batch(b, t, draft->n_past, true);
+        if (llama_decode(draft->ctx, b) != 0) break;
+        dk.push_back(t);
+        draft->n_past++;
+    }
+    return true;
+}
+
+// Prompt lookup: busca la aparición más reciente de los últimos 'ngram' tokens
+// de la secuencia (kv_tokens + id: prompt y salida) y propone lo que la siguió.
+// Útil cuando la respuesta copia tramos del prompt (resúmenes, edición de código).
+// Un índice hash n-grama -> última posición (direccionamiento abierto, tamaño
+// fijo >= 2*n_ctx) se actualiza con los tokens aceptados, así cada paso cuesta
+// O(1) en vez de recorrer el historial. kv_tokens sólo crece salvo en un
+// context shift, que obliga a reconstruirlo.
+typedef struct {
+    uint64_t key;
+    int32_t  pos;           // -1 = libre
+} NgramSlot;
+
+typedef struct {
+    std::vector<NgramSlot> slots;
+    uint64_t mask;
+    int      ngram;
+    int      n_indexed;     // Posiciones de kv_tokens ya indexadas
+    int      n_shifts;      // state->n_ctx_shifts al indexar
+} NgramIndex;
+
+static uint64_t ngram_hash(const llama_token *t, int n) {
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < n; i++) {
+        h ^= (uint32_t)t[i];
+        h *= 1099511628211ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static void ngram_index_init(NgramIndex *ix, int n_ctx, int ngram) {
+    size_t size = 1;
+    while (size < (size_t)n_ctx * 2) size <<= 1;
+    NgramSlot empty = { 0, -1 };
+    ix->slots.assign(size, empty);
+    ix->mask = size - 1;
+    ix->ngram = ngram;
+    ix->n_indexed = 0;
+    ix->n_shifts = 0;
+}
+
+// Indexa los n-gramas que empiezan en posiciones nuevas de kv_tokens
+static void ngram_index_update(NgramIndex *ix, const LlamaState *state) {
+    const std::vector<llama_token> &h = *state->kv_tokens;
+    if (ix->n_shifts != state->n_ctx_shifts) {
+        NgramSlot empty = { 0, -1 };
+        std::fill(ix->slots.begin(), ix->slots.end(), empty);
+        ix->n_indexed = 0;
+        ix->n_shifts = state->n_ctx_shifts;
+    }
+    for (int j = ix->n_indexed; j + ix->ngram <= (int)h.size(); j++) {
+        uint64_t key = ngram_hash(h.data() + j, ix->ngram);
+        uint64_t i = key & ix->mask;
+        while (ix->slots[i].pos >= 0 && ix->slots[i].key != key) i = (i + 1) & ix->mask;
+        ix->slots[i].key = key;
+        ix->slots[i].pos = j;
+        ix->n_indexed = j + 1;
+    }
+}
+
+static void lookup_propose(LlamaState *state, NgramIndex *ix, llama_token id, int n_want,
+                           std::vector<llama_token> &out) {
+    const std::vector<llama_token> &h = *state->kv_tokens;
+    const int ngram = ix->ngram;
+    const int n_kv = (int)h.size();
+    const int n_h = n_kv + 1;
+    if (n_h <= ngram) return;
+    
+    ngram_index_update(ix, state);
+    
+    // Cola de la secuencia: los últimos ngram-1 tokens del historial + id
+    llama_token tail[SPEC_NGRAM_MAX];
+    for (int k = 0; k < ngram - 1; k++) tail[k] = h[n_kv - ngram + 1 + k];
+    tail[ngram - 1] = id;
+    uint64_t key = ngram_hash(tail, ngram);
+    
+    uint64_t i = key & ix->mask;
+    while (ix->slots[i].pos >= 0 && ix->slots[i].key != key) i = (i + 1) & ix->mask;
+    int j = ix->slots[i].pos;
+    if (j < 0) return;
+    // Colisión de hash: confirmar el n-grama
+    for (int k = 0; k < ngram; k++) {
+        if (h[j + k] != tail[k]) return;
+    }
+    
+    for (int t = j + ngram; t < n_h && (int)out.size() < n_want; t++) {
+        out.push_back((t < n_kv) ? h[t] : id);
+    }
+}
+
+// Bucle de generación con verificación de borradores. Mismo contrato que generate_loop.
+static int generate_loop_spec(Tcl_Interp *interp, LlamaState *state, TextStream *ts,
+                              const std::vector<llama_token> & stop_ids, const SpecParams *spec,
+                              const std::atomic<int> *cancel, std::string &err) {
+    int max_tokens = (state->n_predict > 0) ? state->n_predict : 4096;
+    int p_cnt = 0;
+    int rc = TCL_OK;
+    int n_draft_max = spec->n_draft;
+    bool drafting = true;
+    
+    struct llama_batch vb = llama_batch_init(n_draft_max + 1, 0, 1);
+    struct llama_batch db = llama_batch_init(spec->draft ? n_draft_max + 1 : 1, 0, 1);
+    std::vector<llama_token> draft;
+    draft.reserve(n_draft_max);
+    NgramIndex lookup;     // Sólo con -lookup; con -draft queda mínimo
+    ngram_index_init(&lookup, spec->draft ? 1 : state->n_ctx, spec->ngram);
+    
+    llama_token id = sample_next(state, -1);
+    
+    while (p_cnt < max_tokens) {
+        if (state->n_past >= state->n_ctx && !context_shift(state)) break;
+        if (cancel && cancel->load()) break;
+        if (!deliver_token(interp, state, ts, id, stop_ids, &rc)) break;
+        
+        // Proponer continuación sin pasarse de max_tokens ni de n_ctx
+        draft.clear();
+        int n_want = std::min(n_draft_max, std::min(max_tokens - p_cnt - 1, state->n_ctx - state->n_past - 1));
+        if (drafting && n_want > 0) {
+            if (spec->draft) {
+                drafting = draft_model_propose(state, spec->draft, id, n_want, db, n_draft_max + 1, draft);
+                if (!drafting) state->draft_disabled = 1;
+            } else {
+                lookup_propose(state, &lookup, id, n_want, draft);
+            }
+        }
+        
+        // Verificar [id, borrador...] en un solo decode
+        vb.n_tokens = 0;
+        fill_batch(vb, id, state->n_past, true);
+        for (size_t i = 0; i < draft.size(); i++) {
+            fill_batch(vb, draft[i], state->n_past + 1 + (int)i, true);
+        }
+        LatTime t_decode = lat_now();
+        if (llama_decode(state->ctx, vb) != 0) {
+            err = "Decode failed during generation";
+            rc = TCL_ERROR;
+            break;
+        }
+        LatTime t_decoded = lat_now();
+        lat_span(&state->lat[LAT_DECODE], t_decode, t_decoded);
+        trace_emit("decode", t_decode, t_decoded, vb.n_tokens);
+        int pos_end = state->n_past + vb.n_tokens;
+        state->kv_tokens->push_back(id);
+        state->n_past++;
+        p_cnt++;
+        state->n_spec_steps++;
+        state->n_drafted += (int)draft.size();
+        
+        bool done = false;
+        size_t i = 0;
+        for (; i < draft.size(); i++) {
+            llama_token s = sample_next(state, (int)i);
+            if (s != draft[i]) {
+                id = s;   // Corrección: queda pendiente como el próximo token
+                break;
+            }
+            state->n_accepted++;
+            if (p_cnt >= max_tokens || (cancel && cancel->load()) ||
+                !deliver_token(interp, state, ts, s, stop_ids, &rc)) {
+                done = true;
+                break;
+            }
+            state->kv_tokens->push_back(s);
+            state->n_past++;
+            p_cnt++;
+        }
+        if (!done && i == draft.size()) {
+            id = sample_next(state, (int)draft.size());
+        }
+        
+        // Quitar del KV los tokens del borrador que no se aceptaron
+        if (state->n_past < pos_end) llama_kv_self_seq_rm(state->ctx, 0, state->n_past, -1);
+        if (done) break;
+    }
+    
+    llama_batch_free(vb);
+    llama_batch_free(db);
+    state->n_gen = p_cnt;
+    return rc;
+}
+
+// Bucle de muestreo/decodificación. El texto sale por el TextStream; en modo
+// síncrono un error del callback deja su mensaje en el intérprete, cualquier
+// otro error se describe en 'err'. 'cancel' (opcional) se consulta por token.
+static int generate_loop(Tcl_Interp *interp, LlamaState *state, TextStream *ts,
+                         const std::vector<llama_token> & stop_ids, const SpecParams *spec,
+                         const std::atomic<int> *cancel, std::string &err) {
+    auto t_start_gen = std::chrono::high_resolution_clock::now();
+    
+    int max_tokens = (state->n_predict > 0) ? state->n_predict : 4096;
+    int p_cnt = 0;
+    int rc = TCL_OK;
+    long allocs_start = g_hot_allocs;
+    struct llama_batch &b = state->tok_batch;
+    
+    state->n_drafted = 0;
+    state->n_accepted = 0;
+    state->n_spec_steps = 0;
+    state->spec_mode = spec_mode(spec);
+    state->draft_disabled = 0;
+    state->n_ctx_shifts = 0;
+    
+    if (spec_active(spec)) {
+        rc = generate_loop_spec(interp, state, ts, stop_ids, spec, cancel, err);
+        p_cnt = state->n_gen;
+    } else while (p_cnt < max_tokens) {
+        if (state->n_past >= state->n_ctx && !context_shift(state)) break;
+        if (cancel && cancel->load()) break;
+        
+        llama_token id = sample_next(state, -1);
+        
+        if (!deliver_token(interp, state, ts, id, stop_ids, &rc)) break;
+        
+        b.n_tokens = 0;
+        fill_batch(b, id, state->n_past, true);
+        state->n_past++;
+        
+        LatTime t_decode = lat_now();
+        if (llama_decode(state->ctx, b) != 0) {
+            state->n_past--;
+            err = "Decode failed during generation";
+            rc = TCL_ERROR;
+            break;
+        }
+        LatTime t_decoded = lat_now();
+        lat_span(&state->lat[LAT_DECODE], t_decode, t_decoded);
+        trace_emit("decode", t_decode, t_decoded, 1);
+        if (state->kv_tokens->size() == state->kv_tokens->capacity()) HOT_ALLOC();
+        state->kv_tokens->push_back(id);
+        p_cnt++;
+    }
+    
+    auto t_end_gen = std::chrono::high_resolution_clock::now();
+    state->t_gen_ms = std::chrono::duration<double, std::milli>(t_end_gen - t_start_gen).count();
+    state->n_gen = p_cnt;
+    state->n_gen_allocs = g_hot_allocs - allocs_start;
+    
+    if (spec_active(spec)) {
+        state->n_drafted_total += state->n_drafted;
+        state->n_accepted_total += state->n_accepted;
+    } else if (state->t_gen_ms > 0.0 && p_cnt > 0) {
+        // Referencia sin especulación para estimar la ganancia
+        state->gen_tps_plain = p_cnt / (state->t_gen_ms / 1000.0);
+    }
+    return rc;
+}
+
+static int run_inference(Tcl_Interp *interp, LlamaState *state, const StreamOpts *so,
+                        std::vector<llama_token> & stop_ids, const std::vector<std::string> & stops,
+                        const SpecParams *spec) {
+    TextStream ts;
+    stream_init(&ts, so, NULL);
+    ts.cb_hist = &state->lat[LAT_CALLBACK];
+    stream_set_stops(&ts, stops);
+    
+    LatTime t_gen = trace_begin();
+    std::string err;
+    if (generate_loop(interp, state, &ts, stop_ids, spec, NULL, err) != TCL_OK) {
+        if (!err.empty()) Tcl_SetObjResult(interp, Tcl_NewStringObj(err.c_str(), -1));
+        stream_free(&ts);
+        return TCL_ERROR;
+    }
+    
+    if (stream_finish(interp, &ts) != TCL_OK) {
+        stream_free(&ts);
+        return TCL_ERROR;
+    }
+    trace_end("generate", t_gen, ts.n_tok_total);
+    
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&ts.resp), -1));
+    stream_free(&ts);
+    return TCL_OK;
+}
+
+/* ----------------- GENERACIÓN ASÍNCRONA (-async) ----------------- */
+// La ingestión y el bucle de generación corren en un hilo nativo; los fragmentos
+// y el fin vuelven al hilo dueño del intérprete con Tcl_ThreadQueueEvent, así el
+// event loop sigue atendiendo sockets. El handle de la petición es un comando
+// "llamareq%p" (igual que los handles de modelo) manejado con llama::request.
+// El comando es dueño de la petición: al borrarlo (wait, free, tras -done o al
+// destruir el intérprete) se libera con Tcl_EventuallyFree, y quien la use a
+// través del event loop la protege con Tcl_Preserve.
+
+#define REQUEST_TAG 0x5145524cU
+
+struct AsyncRequest {
+    unsigned int  tag;
+    char          name[64];
+    LlamaState   *state;
+    Tcl_Interp   *interp;
+    Tcl_ThreadId  owner;
+    Tcl_ThreadId  worker;
+    std::vector<llama_token> tokens;     // Prompt pendiente de ingerir
+    std::vector<llama_token> stop_ids;
+    SpecParams    spec;
+    std::string   done_cmd;
+    int           keep;         // Con -done: conservar el handle tras invocarlo
+    std::string   progress_cmd;
+    TextStream    stream;
+    std::atomic<int> cancel;
+    
+    // Resultado: escrito por el hilo de trabajo antes de encolar el evento final
+    int           rc;
+    std::string   error;
+    
+    // Sólo el hilo dueño lee/escribe estos campos
+    int           completed;
+    int           cb_failed;
+    int           waiting;      // Hay un llama::request wait en curso
+    int           deleted;      // El comando ya no existe (ni, quizá, el intérprete)
+};
+
+typedef struct {
+    Tcl_Event     header;
+    AsyncRequest *req;
+    int           kind;      // ASYNC_PIECE / ASYNC_PROGRESS / ASYNC_DONE
+    int           n_done;    // Progreso de la ingestión (ASYNC_PROGRESS)
+    int           n_total;
+    int           len;
+    char          text[1];
+} AsyncEvent;
+
+enum { ASYNC_PIECE = 0, ASYNC_DONE, ASYNC_PROGRESS };
+
+static int async_event_proc(Tcl_Event *evPtr, int flags);
+
+static void async_queue(AsyncRequest *req, int kind, const char *text, int len, int n_done, int n_total) {
+    // Tcl libera el evento al despacharlo, así que este ckalloc es inevitable
+    AsyncEvent *ev = (AsyncEvent*)ckalloc(sizeof(AsyncEvent) + len);
+    HOT_ALLOC();
+    ev->req = req;
+    ev->kind = kind;
+    ev->n_done = n_done;
+    ev->n_total = n_total;
+    ev->len = len;
+    if (len > 0) memcpy(ev->text, text, len);
+    ev->text[len] = 0;
+    
+    ev->header.proc = async_event_proc;
+    Tcl_ThreadQueueEvent(req->owner, (Tcl_Event*)ev, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(req->owner);
+}
+
+static void async_queue_piece(struct AsyncRequest *req, const char *text, int len, int n_tok, int n_total) {
+    async_queue(req, ASYNC_PIECE, text, len, n_tok, n_total);
+}
+
+// Progreso de ingestión desde el hilo de trabajo; también es el punto de cancelación
+static int async_progress_fn(void *data, int n_done, int n_total) {
+    AsyncRequest *req = (AsyncRequest*)data;
+    if (!req->progress_cmd.empty()) {
+        AsyncEvent *ev = (AsyncEvent*)ckalloc(sizeof(AsyncEvent));
+        ev->req = req;
+        ev->kind = ASYNC_PROGRESS;
+        ev->n_done = n_done;
+        ev->n_total = n_total;
+        ev->len = 0;
+        ev->text[0] = 0;
+        ev->header.proc = async_event_proc;
+        Tcl_ThreadQueueEvent(req->owner, (Tcl_Event*)ev, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(req->owner);
+    }
+    return req->cancel.load();
+}
+
+static void async_request_free(char *cd) {
+    AsyncRequest *req = (AsyncRequest*)cd;
+    stream_free(&req->stream);
+    req->tag = 0;
+    delete req;
+}
+
+// Delete proc del comando "llamareq...". Si el hilo sigue corriendo se cancela
+// y el evento final libera la petición tras el join.
+static void async_request_deleted(ClientData cd) {
+    AsyncRequest *req = (AsyncRequest*)cd;
+    req->deleted = 1;
+    req->cancel.store(1);
+    if (req->completed) Tcl_EventuallyFree(req, async_request_free);
+}
+
+static int async_event_dispatch(AsyncEvent *ev, AsyncRequest *req);
+
+// Se ejecuta en el hilo dueño desde el event loop. Un callback puede hacer
+// wait/free sobre la misma petición: se protege mientras se atiende el evento.
+static int async_event_proc(Tcl_Event *evPtr, int flags) {
+    AsyncEvent *ev = (AsyncEvent*)evPtr;
+    AsyncRequest *req = ev->req;
+    Tcl_Preserve(req);
+    int rc = async_event_dispatch(ev, req);
+    Tcl_Release(req);
+    return rc;
+}
+
+static int async_event_dispatch(AsyncEvent *ev, AsyncRequest *req) {
+    Tcl_Interp *interp = req->interp;
+    
+    if (ev->kind == ASYNC_PROGRESS) {
+        if (!req->cb_failed && !req->deleted) {
+            Tcl_Obj *cmd = Tcl_NewListObj(0, NULL);
+            Tcl_IncrRefCount(cmd);
+            Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(req->progress_cmd.c_str(), -1));
+            Tcl_ListObjAppendElement(interp, cmd, Tcl_NewIntObj(ev->n_done));
+            Tcl_ListObjAppendElement(interp, cmd, Tcl_NewIntObj(ev->n_total));
+            int rc = Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
+            if (rc == TCL_ERROR) Tcl_BackgroundException(interp, TCL_ERROR);
+            if (rc != TCL_OK) {
+                // break o error cancelan, igual que en modo síncrono
+                req->cb_failed = (rc == TCL_ERROR);
+                req->cancel.store(1);
+            }
+            Tcl_DecrRefCount(cmd);
+        }
+        return 1;
+    }
+    
+    if (ev->kind == ASYNC_PIECE) {
+        // n_done/n_total llevan los conteos de tokens del fragmento
+        if (!req->cb_failed && !req->deleted) {
+            if (stream_output(interp, &req->stream, ev->text, ev->len, ev->n_done, ev->n_total,
+                              TCL_EVAL_GLOBAL) != TCL_OK) {
+                // Un callback roto cancela la generación, igual que en modo síncrono
+                Tcl_BackgroundException(interp, TCL_ERROR);
+                req->cb_failed = 1;
+                req->cancel.store(1);
+            }
+        }
+        return 1;
+    }
+    
+    int thread_rc;
+    Tcl_JoinThread(req->worker, &thread_rc);
+    req->completed = 1;
+    // Los fragmentos llegan antes que el fin: incluye un fallo en el último envío
+    if (req->cb_failed && req->rc == TCL_OK) {
+        req->rc = TCL_ERROR;
+        req->error = "Stream callback failed";
+    }
+    req->state->busy = 0;
+    if (req->spec.draft) req->spec.draft->busy = 0;
+    
+    if (req->deleted) {
+        Tcl_EventuallyFree(req, async_request_free);
+        return 1;
+    }
+    if (!req->done_cmd.empty()) {
+        Tcl_Obj *cmd = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(cmd);
+        Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(req->done_cmd.c_str(), -1));
+        Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj(req->name, -1));
+        if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK) {
+            Tcl_BackgroundException(interp, TCL_ERROR);
+        }
+        Tcl_DecrRefCount(cmd);
+        // Sin -keep el handle sólo vive durante el callback (que puede leer el
+        // resultado con wait); un wait en curso lo borra él mismo al volver
+        if (!req->keep && !req->deleted && !req->waiting) Tcl_DeleteCommand(interp, req->name);
+    }
+    return 1;
+}
+
+static Tcl_ThreadCreateType async_worker(ClientData cd) {
+    AsyncRequest *req = (AsyncRequest*)cd;
+    LlamaState *state = req->state;
+    
+    req->rc = TCL_OK;
+    if (!req->tokens.empty()) {
+        IngestProgress prog = { async_progress_fn, req };
+        int irc = ingest_prompt(state, req->tokens.data(), (int)req->tokens.size(), &prog);
+        if (irc != INGEST_OK) {
+            req->rc = TCL_ERROR;
+            req->error = (irc == INGEST_CANCELLED) ? "Prompt ingestion cancelled" : "Decode failed";
+        }
+    }
+    LatTime t_gen = trace_begin();
+    if (req->rc == TCL_OK) {
+        req->rc = generate_loop(NULL, state, &req->stream, req->stop_ids, &req->spec, &req->cancel, req->error);
+    }
+    if (req->rc == TCL_OK) req->rc = stream_finish(NULL, &req->stream);
+    trace_end("generate", t_gen, req->stream.n_tok_total);
+    
+    async_queue(req, ASYNC_DONE, NULL, 0, 0, 0);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+// Lanza la petición en un hilo nuevo y deja su handle como resultado
+static int start_async(Tcl_Interp *interp, LlamaState *state, const llama_token *tokens, int n_tok,
+                       std::vector<llama_token> & stop_ids, const std::vector<std::string> & stops,
+                       const SpecParams *spec, const StreamOpts *so, const char *done_cmd,
+                       int keep, Tcl_Obj *progress_cmd) {
+    AsyncRequest *req = new AsyncRequest();
+    req->tag = REQUEST_TAG;
+    snprintf(req->name, sizeof(req->name), "llamareq%p", (void*)req);
+    req->state = state;
+    req->interp = interp;
+    req->owner = Tcl_GetCurrentThread();
+    req->tokens.assign(tokens, tokens + n_tok);
+    req->stop_ids.swap(stop_ids);
+    req->spec = *spec;
+    if (done_cmd) req->done_cmd = done_cmd;
+    req->keep = keep;
+    if (progress_cmd) req->progress_cmd = Tcl_GetString(progress_cmd);
+    req->cancel.store(0);
+    req->rc = TCL_OK;
+    req->completed = 0;
+    req->cb_failed = 0;
+    req->waiting = 0;
+    req->deleted = 0;
+    stream_init(&req->stream, so, NULL);
+    stream_set_stops(&req->stream, stops);
+    req->stream.async = req;
+    req->stream.cb_hist = &state->lat[LAT_CALLBACK];
+    
+    // El borrador también queda ocupado mientras corre la petición
+    state->busy = 1;
+    if (req->spec.draft) req->spec.draft->busy = 1;
+    if (Tcl_CreateThread(&req->worker, async_worker, req, TCL_THREAD_STACK_DEFAULT,
+                         TCL_THREAD_JOINABLE) != TCL_OK) {
+        state->busy = 0;
+        if (req->spec.draft) req->spec.draft->busy = 0;
+        stream_free(&req->stream);
+        delete req;
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Failed to create worker thread", -1));
+        return TCL_ERROR;
+    }
+    
+    Tcl_CreateObjCommand(interp, req->name, NULL, req, async_request_deleted);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(req->name, -1));
+    return TCL_OK;
+}
+
+/* ----------------- PLANTILLA DE CHAT ----------------- */
+// Renderiza una lista de mensajes {role ... content ...} con el template del modelo.
+// Devuelve la longitud del texto en 'formatted' o -1 con el error en el intérprete.
+static int32_t render_chat_template(Tcl_Interp *interp, LlamaState *state, Tcl_Obj *messages,
+                                    std::vector<char> &formatted) {
+    int n_msgs;
+    Tcl_Obj **msgs_elems;
+    if (Tcl_ListObjGetElements(interp, messages, &n_msgs, &msgs_elems) != TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid messages list", -1));
+        return -1;
+    }
+    
+    std::vector<llama_chat_message> cmsgs;
+    std::vector<char*> allocated_strings;
+    
+    for (int i = 0; i < n_msgs; i++) {
+        Tcl_Obj *v_role, *v_content;
+        Tcl_Obj *role_key = Tcl_NewStringObj("role", -1);
+        Tcl_Obj *content_key = Tcl_NewStringObj("content", -1);
+        
+        Tcl_IncrRefCount(role_key);
+        Tcl_IncrRefCount(content_key);
+        
+        Tcl_DictObjGet(interp, msgs_elems[i], role_key, &v_role);
+        Tcl_DictObjGet(interp, msgs_elems[i], content_key, &v_content);
+        
+        Tcl_DecrRefCount(role_key);
+        Tcl_DecrRefCount(content_key);
+        
+        if (v_role && v_content) {
+            char* role_str = strdup(Tcl_GetString(v_role));
+            char* content_str = strdup(Tcl_GetString(v_content));
+            
+            if (!role_str || !content_str) {
+                // Cleanup on allocation failure
+                for (auto ptr : allocated_strings) free(ptr);
+                free(role_str);
+                free(content_str);
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("Memory allocation failed", -1));
+                return -1;
+            }
+            
+            allocated_strings.push_back(role_str);
+            allocated_strings.push_back(content_str);
+            cmsgs.push_back({role_str, content_str});
+        }
+    }
+
+    // Obtener template del modelo con buffer dinámico
+    char tmpl_buffer[256];
+    int tmpl_ret = llama_model_meta_val_str(state->model, "tokenizer.chat_template", 
+                                             tmpl_buffer, sizeof(tmpl_buffer));
+    
+    std::string tmpl;
+    if (tmpl_ret > 0 && tmpl_ret < (int)sizeof(tmpl_buffer)) {
+        tmpl = std::string(tmpl_buffer);
+    } else if (tmpl_ret > (int)sizeof(tmpl_buffer)) {
+        // Template es más grande, usar buffer dinámico
+        std::vector<char> large_buffer(tmpl_ret + 1);
+        llama_model_meta_val_str(state->model, "tokenizer.chat_template", 
+                                  large_buffer.data(), large_buffer.size());
+        tmpl = std::string(large_buffer.data());
+    } else {
+        // Sin template, usar fallback simple
+        tmpl = "{% for message in messages %}{{ message.role }}: {{ message.content }}\n{% endfor %}";
+    }
+
+    int32_t fmt_len = llama_chat_apply_template(tmpl.c_str(), cmsgs.data(), cmsgs.size(), 
+                                                  true, NULL, 0);
+    
+    if (fmt_len < 0) {
+        for (auto ptr : allocated_strings) free(ptr);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Template application failed", -1));
+        return -1;
+    }
+    
+    formatted.resize(fmt_len + 1);
+    llama_chat_apply_template(tmpl.c_str(), cmsgs.data(), cmsgs.size(), true, 
+                               formatted.data(), fmt_len + 1);
+    
+    // Liberar strings asignados
+    for (auto ptr : allocated_strings) free(ptr);
+    
+    return fmt_len;
+}
+
+/* ----------------- LLAMA::GENERATE (Stateful) ----------------- */
+static int Llama_Generate_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::generate handle prompt ?-callback proc? ?-options dict? ?-profile name? ?-reset bool? ?-stop list? ?-stop_ids list? ?-system string? ?-max_tokens int? ?-draft handle? ?-lookup ngram? ?-draft_n int? ?-progress proc? ?-async bool? ?-done proc? ?-keep bool?", -1));
+        return TCL_ERROR;
+    }
+    
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
+    if (check_idle(interp, state) != TCL_OK) return TCL_ERROR;
+    piece_table_ensure(state->pieces);
+
+    const char *prompt = Tcl_GetString(objv[2]);
+    StreamOpts so;
+    char *done_cmd = NULL;
+    char *system_msg = NULL;
+    int reset = 0;
+    int async = 0;
+    int keep = 0;
+    std::vector<llama_token> stop_ids;
+    std::vector<std::string> stops;
+    SpecParams spec;
+    Tcl_Obj *progress_cmd = NULL;
+    StageEntry *grammar = NULL;
+    Tcl_Obj *bias_obj = NULL;
+    Tcl_Obj *ban_obj = NULL;
+    spec_params_init(&spec);
+    stream_opts_init(&so);
+
+    for (int i = 3; i < objc; i += 2) {
+        if (i + 1 >= objc) break;
+        const char *opt = Tcl_GetString(objv[i]);
+        if (stream_opts_parse(interp, opt, objv[i+1], &so) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-async") == 0) Tcl_GetBooleanFromObj(interp, objv[i+1], &async);
+        if (strcmp(opt, "-done") == 0) done_cmd = Tcl_GetString(objv[i+1]);
+        if (strcmp(opt, "-keep") == 0 && Tcl_GetBooleanFromObj(interp, objv[i+1], &keep) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-progress") == 0) progress_cmd = objv[i+1];
+        if (strcmp(opt, "-options") == 0) apply_options(interp, objv[i+1], state);
+        if (strcmp(opt, "-profile") == 0 && apply_profile(interp, objv[i+1], state) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-reset") == 0) Tcl_GetBooleanFromObj(interp, objv[i+1], &reset);
+        if (strcmp(opt, "-system") == 0) system_msg = Tcl_GetString(objv[i+1]);
+        if (strcmp(opt, "-max_tokens") == 0) {
+            int max_tokens;
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &max_tokens) == TCL_OK) {
+                state->n_predict = max_tokens;
+            }
+        }
+        if (strcmp(opt, "-stop") == 0 && parse_stop_strings(interp, objv[i+1], stops) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-grammar") == 0 && grammar_lookup(interp, state, objv[i+1], 0, &grammar) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-json_schema") == 0 && grammar_lookup(interp, state, objv[i+1], 1, &grammar) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-logit_bias") == 0) bias_obj = objv[i+1];
+        if (strcmp(opt, "-ban_strings") == 0) ban_obj = objv[i+1];
+        if (strcmp(opt, "-draft") == 0 && parse_draft_handle(interp, state, objv[i+1], &spec) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-lookup") == 0) {
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &spec.ngram) != TCL_OK) return TCL_ERROR;
+            if (spec.ngram < 0) spec.ngram = 0;
+            if (spec.ngram > SPEC_NGRAM_MAX) spec.ngram = SPEC_NGRAM_MAX;
+        }
+        if (strcmp(opt, "-draft_n") == 0) {
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &spec.n_draft) != TCL_OK) return TCL_ERROR;
+            if (spec.n_draft < 1) spec.n_draft = 1;
+            if (spec.n_draft > SPEC_DRAFT_MAX) spec.n_draft = SPEC_DRAFT_MAX;
+        }
+        if (strcmp(opt, "-stop_ids") == 0) {
+            int se; Tcl_Obj **sel;
+            if (Tcl_ListObjGetElements(interp, objv[i+1], &se, &sel) == TCL_OK) {
+                for (int k=0; k<se; k++) {
+                    int id;
+                    if (Tcl_GetIntFromObj(interp, sel[k], &id) == TCL_OK) {
+                        stop_ids.push_back(id);
+                    }
+                }
+            }
+        }
+    }
+    StageEntry *bias = NULL;
+    if ((bias_obj || ban_obj) && bias_lookup(interp, state, bias_obj, ban_obj, &bias) != TCL_OK) return TCL_ERROR;
+    use_stages(state, grammar, bias);
+
+    if (reset) {
+        state->n_past = 0;
+        state->kv_tokens->clear();
+        llama_kv_self_seq_rm(state->ctx, 0, -1, -1);
+    }
+    
+    // Construir prompt con system message si existe
+    std::string full_prompt;
+    if (system_msg && strlen(system_msg) > 0 && state->n_past == 0) {
+        full_prompt = std::string(system_msg) + "\n\n" + std::string(prompt);
+    } else {
+        full_prompt = std::string(prompt);
+    }
+    
+    LatTime t_tok = trace_begin();
+    std::vector<llama_token> tokens(full_prompt.length() + 256);
+    int n_tok = llama_tokenize(state->vocab, full_prompt.c_str(), full_prompt.length(), 
+                                tokens.data(), tokens.size(), (state->n_past == 0), false);
+    trace_end("tokenize", t_tok, n_tok);
+    
+    if (n_tok < 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Tokenization failed", -1));
+        return TCL_ERROR;
+    }
+
+    // Verificar overflow de contexto (con ctx_shift se libera espacio primero)
+    while (state->n_past + n_tok >= state->n_ctx && context_shift(state)) {}
+    if (state->n_past + n_tok >= state->n_ctx) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Context overflow: n_past=%d + n_tok=%d >= n_ctx=%d", 
+                 state->n_past, n_tok, state->n_ctx);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(msg, -1));
+        return TCL_ERROR;
+    }
+
+    if (async) {
+        return start_async(interp, state, tokens.data(), n_tok, stop_ids, stops, &spec, &so, done_cmd, keep, progress_cmd);
+    }
+
+    if (ingest_prompt_cmd(interp, state, tokens.data(), n_tok, progress_cmd) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    return run_inference(interp, state, &so, stop_ids, stops, &spec);
+}
+
+/* ----------------- LLAMA::CHAT (Stateless + reutilización de prefijo KV) ----------------- */
+static int Llama_Chat(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::chat handle messages ?-callback proc? ?-options dict? ?-profile name? ?-stop list? ?-stop_ids list? ?-max_tokens int? ?-draft handle? ?-lookup ngram? ?-draft_n int? ?-progress proc? ?-async bool? ?-done proc? ?-keep bool?", -1));
+        return TCL_ERROR;
+    }
+    
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
+    if (check_idle(interp, state) != TCL_OK) return TCL_ERROR;
+    piece_table_ensure(state->pieces);
+
+    StreamOpts so;
+    char *done_cmd = NULL;
+    int async = 0;
+    int keep = 0;
+    std::vector<llama_token> stop_ids;
+    std::vector<std::string> stops;
+    SpecParams spec;
+    Tcl_Obj *progress_cmd = NULL;
+    StageEntry *grammar = NULL;
+    Tcl_Obj *bias_obj = NULL;
+    Tcl_Obj *ban_obj = NULL;
+    spec_params_init(&spec);
+    stream_opts_init(&so);
+    
+    for (int i = 3; i < objc; i += 2) {
+        if (i + 1 >= objc) break;
+        const char *opt = Tcl_GetString(objv[i]);
+        if (stream_opts_parse(interp, opt, objv[i+1], &so) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-async") == 0) Tcl_GetBooleanFromObj(interp, objv[i+1], &async);
+        if (strcmp(opt, "-done") == 0) done_cmd = Tcl_GetString(objv[i+1]);
+        if (strcmp(opt, "-keep") == 0 && Tcl_GetBooleanFromObj(interp, objv[i+1], &keep) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-progress") == 0) progress_cmd = objv[i+1];
+        if (strcmp(opt, "-options") == 0) apply_options(interp, objv[i+1], state);
+        if (strcmp(opt, "-profile") == 0 && apply_profile(interp, objv[i+1], state) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-max_tokens") == 0) {
+            int max_tokens;
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &max_tokens) == TCL_OK) {
+                state->n_predict = max_tokens;
+            }
+        }
+        if (strcmp(opt, "-stop") == 0 && parse_stop_strings(interp, objv[i+1], stops) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-grammar") == 0 && grammar_lookup(interp, state, objv[i+1], 0, &grammar) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-json_schema") == 0 && grammar_lookup(interp, state, objv[i+1], 1, &grammar) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-logit_bias") == 0) bias_obj = objv[i+1];
+        if (strcmp(opt, "-ban_strings") == 0) ban_obj = objv[i+1];
+        if (strcmp(opt, "-draft") == 0 && parse_draft_handle(interp, state, objv[i+1], &spec) != TCL_OK) return TCL_ERROR;
+        if (strcmp(opt, "-lookup") == 0) {
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &spec.ngram) != TCL_OK) return TCL_ERROR;
+            if (spec.ngram < 0) spec.ngram = 0;
+            if (spec.ngram > SPEC_NGRAM_MAX) spec.ngram = SPEC_NGRAM_MAX;
+        }
+        if (strcmp(opt, "-draft_n") == 0) {
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &spec.n_draft) != TCL_OK) return TCL_ERROR;
+            if (spec.n_draft < 1) spec.n_draft = 1;
+            if (spec.n_draft > SPEC_DRAFT_MAX) spec.n_draft = SPEC_DRAFT_MAX;
+        }
+        if (strcmp(opt, "-stop_ids") == 0) {
+            int se; Tcl_Obj **sel;
+            if (Tcl_ListObjGetElements(interp, objv[i+1], &se, &sel) == TCL_OK) {
+                for (int k=0; k<se; k++) {
+                    int id;
+                    if (Tcl_GetIntFromObj(interp, sel[k], &id) == TCL_OK) {
+                        stop_ids.push_back(id);
+                    }
+                }
+            }
+        }
+    }
+    StageEntry *bias = NULL;
+    if ((bias_obj || ban_obj) && bias_lookup(interp, state, bias_obj, ban_obj, &bias) != TCL_OK) return TCL_ERROR;
+    use_stages(state, grammar, bias);
+
+    LatTime t_tmpl = trace_begin();
+    std::vector<char> formatted;
+    int32_t fmt_len = render_chat_template(interp, state, objv[2], formatted);
+    if (fmt_len < 0) return TCL_ERROR;
+    trace_end("template", t_tmpl, fmt_len);
+
+    LatTime t_tok = trace_begin();
+    std::vector<llama_token> tokens(fmt_len + 1024);
+    int n_tok = llama_tokenize(state->vocab, formatted.data(), fmt_len, 
+                                tokens.data(), tokens.size(), true, false);
+    trace_end("tokenize", t_tok, n_tok);
+    
+    if (n_tok <= 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Tokenization failed", -1));
+        return TCL_ERROR;
+    }
+
+    // CHAT ES STATELESS, pero el historial renderizado suele compartir un prefijo
+    // largo con lo que ya está en el KV cache: sólo se descarta la cola divergente.
+    std::vector<llama_token> &cached = *state->kv_tokens;
+    int n_common = 0;
+    int n_cmp = std::min((int)cached.size(), n_tok);
+    while (n_common < n_cmp && cached[n_common] == tokens[n_common]) n_common++;
+    
+    // Re-evaluar siempre al menos el último token para tener logits frescos
+    if (n_common >= n_tok) n_common = n_tok - 1;
+    
+    // Modelos recurrentes no admiten borrado parcial: caer a reset completo
+    // (sólo de la secuencia 0; las demás pertenecen a llama::batch)
+    if (n_common > 0 && !llama_kv_self_seq_rm(state->ctx, 0, n_common, -1)) n_common = 0;
+    if (n_common == 0) llama_kv_self_seq_rm(state->ctx, 0, -1, -1);
+    cached.resize(n_common);
+    state->n_past = n_common;
+
+    if (async) {
+        return start_async(interp, state, tokens.data() + n_common, n_tok - n_common,
+                           stop_ids, stops, &spec, &so, done_cmd, keep, progress_cmd);
+    }
+
+    if (ingest_prompt_cmd(interp, state, tokens.data() + n_common, n_tok - n_common, progress_cmd) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    return run_inference(interp, state, &so, stop_ids, stops, &spec);
+}
+
+/* ----------------- LLAMA::REQUEST (wait / poll / cancel) ----------------- */
+static int Llama_Request_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    static const char *subcmds[] = {"wait", "poll", "cancel", "free", NULL};
+    enum { REQUEST_WAIT, REQUEST_POLL, REQUEST_CANCEL, REQUEST_FREE };
+    
+    if (objc != 3) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::request wait|poll|cancel|free request", -1));
+        return TCL_ERROR;
+    }
+    
+    int index;
+    if (Tcl_GetIndexFromObj(interp, objv[1], subcmds, "subcommand", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    
+    Tcl_CmdInfo info;
+    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[2]), &info) == 0 ||
+        !info.objClientData || ((AsyncRequest*)info.objClientData)->tag != REQUEST_TAG) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid request handle", -1));
+        return TCL_ERROR;
+    }
+    AsyncRequest *req = (AsyncRequest*)info.objClientData;
+    
+    switch (index) {
+    case REQUEST_POLL:
+        if (!req->completed) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("running", -1));
+        } else {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj((req->rc == TCL_OK) ? "done" : "error", -1));
+        }
+        return TCL_OK;
+    
+    case REQUEST_CANCEL:
+        req->cancel.store(1);
+        return TCL_OK;
+    
+    case REQUEST_FREE:
+        // Cancela si sigue corriendo; el delete proc libera al terminar el hilo
+        if (req->waiting) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Request is being waited on", -1));
+            return TCL_ERROR;
+        }
+        Tcl_DeleteCommand(interp, req->name);
+        return TCL_OK;
+    
+    case REQUEST_WAIT: {
+        if (req->waiting) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Request is already being waited on", -1));
+            return TCL_ERROR;
+        }
+        // Atender el event loop (fragmentos incluidos) hasta que llegue el fin;
+        // un callback podría borrar el handle mientras tanto
+        Tcl_Preserve(req);
+        req->waiting = 1;
+        while (!req->completed) {
+            Tcl_DoOneEvent(TCL_ALL_EVENTS);
+        }
+        req->waiting = 0;
+        
+        int rc = req->rc;
+        if (rc == TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&req->stream.resp), -1));
+        } else {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(req->error.c_str(), -1));
+        }
+        
+        if (!req->deleted) Tcl_DeleteCommand(interp, req->name);
+        Tcl_Release(req);
+        return rc;
+    }
+    }
+    return TCL_OK;
+}
+
+/* ----------------- MOTOR MULTI-SECUENCIA (continuous batching) ----------------- */
+// Varias peticiones en vuelo sobre el mismo contexto. Cada una ocupa su propia
+// secuencia del KV cache (la 0 queda reservada para generate/chat del handle) y
+// cada llama_decode lleva un token por secuencia activa. Las peticiones nuevas se
+// admiten entre pasos, ingiriendo su prompt dentro del mismo batch.
+
+enum { REQ_PENDING = 0, REQ_ACTIVE, REQ_DONE, REQ_FAILED };
+
+typedef struct {
+    int          id;
+    int          status;
+    llama_seq_id seq_id;
+    struct llama_sampler *sampler;
+    std::vector<llama_token> prompt;
+    std::vector<llama_token> stop_ids;
+    size_t       n_ingested;   // Tokens del prompt ya decodificados
+    int          n_past;
+    int          n_gen;
+    int          max_tokens;
+    llama_token  next;         // Último token muestreado, pendiente de decodificar
+    int          i_batch;      // Índice de logits en el batch del paso actual (-1 = ninguno)
+    int          n_added;      // Posiciones agregadas al batch del paso actual
+    size_t       ingest_start; // n_ingested al comenzar el paso (para revertir)
+    std::string  error;
+    TextStream   stream;
+} BatchRequest;
+
+struct BatchEngine {
+    struct llama_batch batch;
+    int    n_batch;
+    int    next_id;
+    std::vector<bool>            seq_busy;   // Índice = seq_id
+    std::deque<BatchRequest*>    pending;
+    std::vector<BatchRequest*>   active;
+    std::map<int, BatchRequest*> finished;
+
+    // Telemetría agregada
+    Tcl_WideInt n_steps;
+    Tcl_WideInt n_tokens;      // Tokens generados sumando todas las secuencias
+    double      t_decode_ms;
+};
+
+static const char *batch_status_name(int status) {
+    switch (status) {
+        case REQ_PENDING: return "pending";
+        case REQ_ACTIVE:  return "active";
+        case REQ_DONE:    return "done";
+        default:          return "failed";
+    }
+}
+
+static BatchEngine *batch_engine_create(LlamaState *state) {
+    BatchEngine *eng = new BatchEngine();
+    eng->n_batch = (int)llama_n_batch(state->ctx);
+    eng->batch = llama_batch_init(eng->n_batch, 0, 1);
+    eng->next_id = 1;
+    eng->seq_busy.assign(llama_n_seq_max(state->ctx), false);
+    eng->seq_busy[0] = true;
+    eng->active.reserve(eng->seq_busy.size());
+    eng->n_steps = 0;
+    eng->n_tokens = 0;
+    eng->t_decode_ms = 0.0;
+    return eng;
+}
+
+static void batch_request_free(BatchRequest *req) {
+    if (req->sampler) llama_sampler_free(req->sampler);
+    stream_free(&req->stream);
+    delete req;
+}
+
+static void batch_engine_free(BatchEngine *eng) {
+    for (auto req : eng->pending) batch_request_free(req);
+    for (auto req : eng->active) batch_request_free(req);
+    for (auto &kv : eng->finished) batch_request_free(kv.second);
+    llama_batch_free(eng->batch);
+    delete eng;
+}
+
+// Libera la secuencia de una petición activa y la mueve a terminadas
+static void batch_release(LlamaState *state, BatchEngine *eng, BatchRequest *req, int status) {
+    if (req->status == REQ_ACTIVE) {
+        llama_kv_self_seq_rm(state->ctx, req->seq_id, -1, -1);
+        eng->seq_busy[req->seq_id] = false;
+    }
+    req->status = status;
+    eng->finished[req->id] = req;
+}
+
+static void batch_drop_finished(BatchEngine *eng) {
+    size_t n = 0;
+    for (size_t r = 0; r < eng->active.size(); r++) {
+        if (eng->active[r]->status == REQ_ACTIVE) eng->active[n++] = eng->active[r];
+    }
+    eng->active.resize(n);
+}
+
+// Un paso del motor: admite pendientes, decodifica un batch con todas las
+// secuencias activas y muestrea. Agrega a done_list los ids que terminaron.
+static int batch_step(Tcl_Interp *interp, LlamaState *state, BatchEngine *eng, Tcl_Obj *done_list) {
+    // 1. Admitir peticiones pendientes mientras haya secuencias libres
+    while (!eng->pending.empty()) {
+        llama_seq_id seq = -1;
+        for (size_t s = 1; s < eng->seq_busy.size(); s++) {
+            if (!eng->seq_busy[s]) { seq = (llama_seq_id)s; break; }
+        }
+        if (seq < 0) break;
+        
+        BatchRequest *req = eng->pending.front();
+        eng->pending.pop_front();
+        req->seq_id = seq;
+        req->status = REQ_ACTIVE;
+        eng->seq_busy[seq] = true;
+        eng->active.push_back(req);
+    }
+    
+    while (!eng->active.empty()) {
+        // 2. Armar el batch: primero un token por secuencia en generación,
+        //    después los prompts pendientes con el presupuesto restante
+        struct llama_batch &batch = eng->batch;
+        batch.n_tokens = 0;
+        
+        for (size_t r = 0; r < eng->active.size(); r++) {
+            BatchRequest *req = eng->active[r];
+            req->i_batch = -1;
+            req->n_added = 0;
+            req->ingest_start = req->n_ingested;
+            if (req->n_ingested < req->prompt.size()) continue;
+            req->i_batch = batch.n_tokens;
+            fill_batch(batch, req->next, req->n_past, true, req->seq_id);
+            req->n_added = 1;
+        }
+        
+        for (size_t r = 0; r < eng->active.size(); r++) {
+            BatchRequest *req = eng->active[r];
+            while (req->n_ingested < req->prompt.size() && batch.n_tokens < eng->n_batch) {
+                bool last = (req->n_ingested + 1 == req->prompt.size());
+                if (last) req->i_batch = batch.n_tokens;
+                fill_batch(batch, req->prompt[req->n_ingested], req->n_past + req->n_added, last, req->seq_id);
+                req->n_ingested++;
+                req->n_added++;
+            }
+        }
+        
+        if (batch.n_tokens == 0) return TCL_OK;
+        
+        auto t_start = std::chrono::high_resolution_clock::now();
+        int ret = llama_decode(state->ctx, batch);
+        auto t_end = std::chrono::high_resolution_clock::now();
+        eng->t_decode_ms += std::chrono::duration<double, std::milli>(t_end - t_start).count();
+        
+        if (ret != 0) {
+            // Revertir lo agregado al batch
+            for (size_t r = 0; r < eng->active.size(); r++) {
+                eng->active[r]->n_ingested = eng->active[r]->ingest_start;
+            }
+            
+            // Sin espacio en el KV: expulsar la petición más reciente y reintentar
+            if (ret == 1 && eng->active.size() > 1) {
+                BatchRequest *victim = eng->active.back();
+                victim->error = "KV cache full";
+                batch_release(state, eng, victim, REQ_FAILED);
+                Tcl_ListObjAppendElement(interp, done_list, Tcl_NewIntObj(victim->id));
+                batch_drop_finished(eng);
+                continue;
+            }
+            
+            for (auto req : eng->active) {
+                req->error = "Decode failed during generation";
+                batch_release(state, eng, req, REQ_FAILED);
+                Tcl_ListObjAppendElement(interp, done_list, Tcl_NewIntObj(req->id));
+            }
+            eng->active.clear();
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Decode failed during generation", -1));
+            return TCL_ERROR;
+        }
+        
+        eng->n_steps++;
+        for (size_t r = 0; r < eng->active.size(); r++) {
+            eng->active[r]->n_past += eng->active[r]->n_added;
+        }
+        break;
+    }
+    
+    // 3. Muestrear cada secuencia que produjo logits en este paso
+    for (auto req : eng->active) {
+        if (req->i_batch < 0) continue;
+        
+        llama_token id = llama_sampler_sample(req->sampler, state->ctx, req->i_batch);
+        llama_sampler_accept(req->sampler, id);
+        
+        int status = REQ_ACTIVE;
+        if (is_stop_token(state, id, req->stop_ids)) {
+            status = REQ_DONE;
+        } else {
+            int n;
+            const char *piece = piece_text(state->pieces, id, &n);
+            if (n > 0 && n < 512) {
+                int rc = stream_push(interp, &req->stream, piece, n);
+                if (rc == STREAM_STOP) status = REQ_DONE;
+                if (rc == STREAM_ERROR) {
+                    req->error = Tcl_GetStringResult(interp);
+                    status = REQ_FAILED;
+                }
+            }
+            req->next = id;
+            req->n_gen++;
+            eng->n_tokens++;
+            if (status == REQ_ACTIVE &&
+                (req->n_gen >= req->max_tokens || req->n_past >= state->n_ctx)) {
+                status = REQ_DONE;
+            }
+        }
+        
+        if (status != REQ_ACTIVE) {
+            if (status == REQ_DONE && stream_finish(interp, &req->stream) != TCL_OK) {
+                req->error = Tcl_GetStringResult(interp);
+                status = REQ_FAILED;
+            }
+            batch_release(state, eng, req, status);
+            Tcl_ListObjAppendElement(interp, done_list, Tcl_NewIntObj(req->id));
+        }
+    }
+    batch_drop_finished(eng);
+    return TCL_OK;
+}
+
+/* ----------------- LLAMA::BATCH (submit / step / run / result / status / cancel) ----------------- */
+static int Llama_Batch_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    static const char *subcmds[] = {"submit", "step", "run", "result", "status", "cancel", NULL};
+    enum { BATCH_SUBMIT, BATCH_STEP, BATCH_RUN, BATCH_RESULT, BATCH_STATUS, BATCH_CANCEL };
+    
+    if (objc < 3) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::batch submit|step|run|result|status|cancel handle ?args?", -1));
+        return TCL_ERROR;
+    }
+    
+    int index;
+    if (Tcl_GetIndexFromObj(interp, objv[1], subcmds, "subcommand", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    
+    LlamaState *state = state_from_obj(interp, objv[2]);
+    if (!state) return TCL_ERROR;
+    BatchEngine *eng = state->engine;
+    
+    if ((index == BATCH_SUBMIT || index == BATCH_STEP || index == BATCH_RUN) &&
+        check_idle(interp, state) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    piece_table_ensure(state->pieces);
+    
+    switch (index) {
+    case BATCH_SUBMIT: {
+        if (objc < 4) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::batch submit handle prompt ?-chat bool? ?-callback proc? ?-options dict? ?-profile name? ?-stop list? ?-stop_ids list? ?-max_tokens int? ?-logit_bias list? ?-ban_strings list?", -1));
+            return TCL_ERROR;
+        }
+        if (llama_n_seq_max(state->ctx) < 2) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Context has a single sequence: use llama::init with n_seq_max > 1", -1));
+            return TCL_ERROR;
+        }
+        if (!eng) eng = state->engine = batch_engine_create(state);
+        
+        // Los parámetros de muestreo de la petición viven en una copia local:
+        // submit no toca el sampler ni las etapas que usan generate/chat
+        int chat = 0;
+        StreamOpts so;
+        SamplerProfile prof;
+        sampler_key_from_state(state, &prof.key);
+        prof.n_predict = state->n_predict;
+        int max_tokens = -2;
+        std::vector<llama_token> stop_ids;
+        std::vector<std::string> stops;
+        Tcl_Obj *bias_obj = NULL;
+        Tcl_Obj *ban_obj = NULL;
+        stream_opts_init(&so);
+        
+        for (int i = 4; i < objc; i += 2) {
+            if (i + 1 >= objc) break;
+            const char *opt = Tcl_GetString(objv[i]);
+            if (strcmp(opt, "-chat") == 0) Tcl_GetBooleanFromObj(interp, objv[i+1], &chat);
+            if (stream_opts_parse(interp, opt, objv[i+1], &so) != TCL_OK) return TCL_ERROR;
+            if (strcmp(opt, "-options") == 0 && parse_sampler_options(interp, objv[i+1], &prof) != TCL_OK) return TCL_ERROR;
+            if (strcmp(opt, "-profile") == 0) {
+                auto it = state->profiles->find(Tcl_GetString(objv[i+1]));
+                if (it == state->profiles->end()) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown sampling profile \"%s\"", Tcl_GetString(objv[i+1])));
+                    return TCL_ERROR;
+                }
+                prof = it->second;
+            }
+            if (strcmp(opt, "-max_tokens") == 0) Tcl_GetIntFromObj(interp, objv[i+1], &max_tokens);
+            if (strcmp(opt, "-stop") == 0 && parse_stop_strings(interp, objv[i+1], stops) != TCL_OK) return TCL_ERROR;
+            if (strcmp(opt, "-logit_bias") == 0) bias_obj = objv[i+1];
+            if (strcmp(opt, "-ban_strings") == 0) ban_obj = objv[i+1];
+            if (strcmp(opt, "-stop_ids") == 0) {
+                int se; Tcl_Obj **sel;
+                if (Tcl_ListObjGetElements(interp, objv[i+1], &se, &sel) == TCL_OK) {
+                    for (int k=0; k<se; k++) {
+                        int id;
+                        if (Tcl_GetIntFromObj(interp, sel[k], &id) == TCL_OK) {
+                            stop_ids.push_back(id);
+                        }
+                    }
+                }
+            }
+        }
+        
+        std::string text;
+        if (chat) {
+            std::vector<char> formatted;
+            int32_t fmt_len = render_chat_template(interp, state, objv[3], formatted);
+            if (fmt_len < 0) return TCL_ERROR;
+            text.assign(formatted.data(), fmt_len);
+        } else {
+            text = Tcl_GetString(objv[3]);
+        }
+        
+        std::vector<llama_token> tokens(text.length() + 256);
+        int n_tok = llama_tokenize(state->vocab, text.c_str(), text.length(),
+                                   tokens.data(), tokens.size(), true, false);
+        if (n_tok <= 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Tokenization failed", -1));
+            return TCL_ERROR;
+        }
+        if (n_tok >= state->n_ctx) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Context overflow: prompt does not fit in n_ctx", -1));
+            return TCL_ERROR;
+        }
+        tokens.resize(n_tok);
+        
+        // Sin gramática en lote: el bias es la única etapa que se admite
+        StageEntry *bias = NULL;
+        if ((bias_obj || ban_obj) && bias_lookup(interp, state, bias_obj, ban_obj, &bias) != TCL_OK) return TCL_ERROR;
+        if (max_tokens == -2) max_tokens = prof.n_predict;
+        
+        BatchRequest *req = new BatchRequest();
+        req->id = eng->next_id++;
+        req->status = REQ_PENDING;
+        req->seq_id = -1;
+        // Cadena propia: cada secuencia necesita su propio estado
+        req->sampler = build_sampler_chain_key(state, &prof.key, NULL, bias);
+        req->prompt.swap(tokens);
+        req->stop_ids.swap(stop_ids);
+        req->n_ingested = 0;
+        req->n_past = 0;
+        req->n_gen = 0;
+        req->max_tokens = (max_tokens > 0) ? max_tokens : 4096;
+        req->next = 0;
+        req->i_batch = -1;
+        stream_init(&req->stream, &so, Tcl_NewIntObj(req->id));
+        req->stream.cb_hist = &state->lat[LAT_CALLBACK];
+        stream_set_stops(&req->stream, stops);
+        eng->pending.push_back(req);
+        
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(req->id));
+        return TCL_OK;
+    }
+    
+    case BATCH_STEP:
+    case BATCH_RUN: {
+        Tcl_Obj *done_list = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(done_list);
+        int rc = TCL_OK;
+        if (eng) {
+            do {
+                rc = batch_step(interp, state, eng, done_list);
+            } while (rc == TCL_OK && index == BATCH_RUN &&
+                     !(eng->active.empty() && eng->pending.empty()));
+        }
+        if (rc == TCL_OK) Tcl_SetObjResult(interp, done_list);
+        Tcl_DecrRefCount(done_list);
+        return rc;
+    }
+    
+    case BATCH_RESULT:
+    case BATCH_CANCEL: {
+        int id;
+        if (objc != 4) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::batch result|cancel handle id", -1));
+            return TCL_ERROR;
+        }
+        if (Tcl_GetIntFromObj(interp, objv[3], &id) != TCL_OK) return TCL_ERROR;
+        
+        if (index == BATCH_CANCEL) {
+            if (eng) {
+                for (auto it = eng->pending.begin(); it != eng->pending.end(); ++it) {
+                    if ((*it)->id == id) {
+                        (*it)->error = "Request cancelled";
+                        batch_release(state, eng, *it, REQ_FAILED);
+                        eng->pending.erase(it);
+                        break;
+                    }
+                }
+                for (auto req : eng->active) {
+                    if (req->id == id) {
+                        req->error = "Request cancelled";
+                        batch_release(state, eng, req, REQ_FAILED);
+                    }
+                }
+                batch_drop_finished(eng);
+            }
+            return TCL_OK;
+        }
+        
+        BatchRequest *req = NULL;
+        if (eng && eng->finished.count(id)) {
+            req = eng->finished[id];
+            eng->finished.erase(id);
+        }
+        if (!req) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Request %d is not finished", id));
+            return TCL_ERROR;
+        }
+        
+        int rc = TCL_OK;
+        if (req->status == REQ_DONE) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&req->stream.resp), -1));
+        } else {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(req->error.c_str(), -1));
+            rc = TCL_ERROR;
+        }
+        batch_request_free(req);
+        return rc;
+    }
+    
+    case BATCH_STATUS: {
+        if (objc == 4) {
+            int id;
+            if (Tcl_GetIntFromObj(interp, objv[3], &id) != TCL_OK) return TCL_ERROR;
+            int status = -1;
+            if (eng) {
+                for (auto req : eng->pending) if (req->id == id) status = req->status;
+                for (auto req : eng->active) if (req->id == id) status = req->status;
+                auto it = eng->finished.find(id);
+                if (it != eng->finished.end()) status = it->second->status;
+            }
+            if (status < 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown request %d", id));
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(batch_status_name(status), -1));
+            return TCL_OK;
+        }
+        
+        Tcl_Obj *dict = Tcl_NewDictObj();
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("slots", -1),
+                       Tcl_NewIntObj((int)llama_n_seq_max(state->ctx) - 1));
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("active", -1),
+                       Tcl_NewIntObj(eng ? (int)eng->active.size() : 0));
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("pending", -1),
+                       Tcl_NewIntObj(eng ? (int)eng->pending.size() : 0));
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("finished", -1),
+                       Tcl_NewIntObj(eng ? (int)eng->finished.size() : 0));
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_steps", -1),
+                       Tcl_NewWideIntObj(eng ? eng->n_steps : 0));
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_tokens", -1),
+                       Tcl_NewWideIntObj(eng ? eng->n_tokens : 0));
+        
+        // Tokens/s agregados sobre el tiempo de decode
+        double t_ms = eng ? eng->t_decode_ms : 0.0;
+        double tps = (t_ms > 0.0) ? (eng->n_tokens / (t_ms / 1000.0)) : 0.0;
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("t_decode_ms", -1), Tcl_NewDoubleObj(t_ms));
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("aggregate_tps", -1), Tcl_NewDoubleObj(tps));
+        Tcl_SetObjResult(interp, dict);
+        return TCL_OK;
+    }
+    }
+    return TCL_OK;
+}
+
+/* ----------------- LLAMA::SESSION - KV cache en disco ----------------- */
+// Guarda la secuencia 0 (estado del KV, tokens residentes y n_past) para
+// restaurarla sin volver a decodificar. Formato:
+//   [SessionHeader 64 bytes][tokens int32 x n_tokens][relleno][estado KV]
+// El estado KV arranca alineado a página: al cargar se mapea el archivo y se
+// pasa el puntero directo a llama_state_seq_set_data, sin copias intermedias.
+
+#define SESSION_MAGIC   "TCLLSES1"
+#define SESSION_VERSION 1
+#define SESSION_ALIGN   4096
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t model_fingerprint;
+    int32_t  n_vocab;
+    int32_t  n_embd;
+    int32_t  n_layer;
+    int32_t  n_tokens;
+    uint64_t tokens_offset;
+    uint64_t state_offset;
+    uint64_t state_size;
+} SessionHeader;
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Identidad del modelo: metadatos y vocabulario completo (tabla de piezas)
+static uint64_t model_fingerprint(LlamaState *state) {
+    piece_table_ensure(state->pieces);
+    const PieceTable *pt = state->pieces;
+    
+    char desc[256];
+    llama_model_desc(state->model, desc, sizeof(desc));
+    uint64_t n_params = llama_model_n_params(state->model);
+    uint64_t size = llama_model_size(state->model);
+    
+    uint64_t h = 14695981039346656037ULL;
+    h = fnv1a(h, desc, strlen(desc));
+    h = fnv1a(h, &n_params, sizeof(n_params));
+    h = fnv1a(h, &size, sizeof(size));
+    h = fnv1a(h, pt->text.data(), pt->text.size());
+    h = fnv1a(h, pt->offset.data(), pt->offset.size() * sizeof(uint32_t));
+    h = fnv1a(h, pt->flags.data(), pt->flags.size());
+    return h;
+}
+
+static void session_fill_header(LlamaState *state, SessionHeader *hdr, int n_tokens, size_t state_size) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, SESSION_MAGIC, 8);
+    hdr->version = SESSION_VERSION;
+    hdr->header_size = sizeof(SessionHeader);
+    hdr->model_fingerprint = model_fingerprint(state);
+    hdr->n_vocab = llama_vocab_n_tokens(state->vocab);
+    hdr->n_embd = llama_model_n_embd(state->model);
+    hdr->n_layer = llama_model_n_layer(state->model);
+    hdr->n_tokens = n_tokens;
+    hdr->tokens_offset = sizeof(SessionHeader);
+    uint64_t end_tokens = hdr->tokens_offset + (uint64_t)n_tokens * sizeof(llama_token);
+    hdr->state_offset = (end_tokens + SESSION_ALIGN - 1) / SESSION_ALIGN * SESSION_ALIGN;
+    hdr->state_size = state_size;
+}
+
+static int session_save(Tcl_Interp *interp, LlamaState *state, const char *path) {
+    size_t state_size = llama_state_seq_get_size(state->ctx, 0);
+    std::vector<uint8_t> blob(state_size);
+    if (state_size > 0 && llama_state_seq_get_data(state->ctx, blob.data(), state_size, 0) != state_size) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Failed to read KV state", -1));
+        return TCL_ERROR;
+    }
+    
+    SessionHeader hdr;
+    session_fill_header(state, &hdr, state->n_past, state_size);
+    
+    // Escribir a un temporal y renombrar: un corte a mitad no deja un archivo roto
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Cannot open \"%s\" for writing", tmp.c_str()));
+        return TCL_ERROR;
+    }
+    
+    static const char zeros[SESSION_ALIGN] = {0};
+    size_t pad = (size_t)(hdr.state_offset - hdr.tokens_offset - (uint64_t)state->n_past * sizeof(llama_token));
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if (ok && state->n_past > 0) {
+        ok = fwrite(state->kv_tokens->data(), sizeof(llama_token), state->n_past, f) == (size_t)state->n_past;
+    }
+    if (ok && pad > 0) ok = fwrite(zeros, 1, pad, f) == pad;
+    if (ok && state_size > 0) ok = fwrite(blob.data(), 1, state_size, f) == state_size;
+    if (fclose(f) != 0) ok = false;
+    
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        remove(tmp.c_str());
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Failed to write session file \"%s\"", path));
+        return TCL_ERROR;
+    }
+    
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)(hdr.state_offset + state_size)));
+    return TCL_OK;
+}
+
+// Vista de sólo lectura del archivo completo (mmap; lectura a memoria en Windows)
+typedef struct {
+    const uint8_t *data;
+    size_t         size;
+#ifdef _WIN32
+    std::vector<uint8_t> *buf;
+#else
+    int            fd;
+#endif
+} FileView;
+
+static bool file_view_open(const char *path, FileView *fv) {
+    fv->data = NULL;
+    fv->size = 0;
+#ifdef _WIN32
+    fv->buf = NULL;
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len <= 0) { fclose(f); return false; }
+    fv->buf = new std::vector<uint8_t>((size_t)len);
+    bool ok = fread(fv->buf->data(), 1, (size_t)len, f) == (size_t)len;
+    fclose(f);
+    if (!ok) { delete fv->buf; fv->buf = NULL; return false; }
+    fv->data = fv->buf->data();
+    fv->size = (size_t)len;
+    return true;
+#else
+    fv->fd = open(path, O_RDONLY);
+    if (fv->fd < 0) return false;
+    struct stat st;
+    if (fstat(fv->fd, &st) != 0 || st.st_size <= 0) {
+        close(fv->fd);
+        return false;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fv->fd, 0);
+    if (p == MAP_FAILED) {
+        close(fv->fd);
+        return false;
+    }
+    madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    fv->data = (const uint8_t*)p;
+    fv->size = (size_t)st.st_size;
+    return true;
+#endif
+}
+
+static void file_view_close(FileView *fv) {
+#ifdef _WIN32
+    delete fv->buf;
+#else
+    if (fv->data) munmap((void*)fv->data, fv->size);
+    close(fv->fd);
+#endif
+    fv->data = NULL;
+}
+
+static int session_load(Tcl_Interp *interp, LlamaState *state, const char *path) {
+    FileView fv;
+    if (!file_view_open(path, &fv)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Cannot open session file \"%s\"", path));
+        return TCL_ERROR;
+    }
+    
+    SessionHeader hdr;
+    const char *bad = NULL;
+    if (fv.size < sizeof(hdr)) {
+        bad = "Not a session file";
+    } else {
+        memcpy(&hdr, fv.data, sizeof(hdr));
+        if (memcmp(hdr.magic, SESSION_MAGIC, 8) != 0 || hdr.header_size != sizeof(hdr)) {
+            bad = "Not a session file";
+        } else if (hdr.version != SESSION_VERSION) {
+            bad = "Unsupported session file version";
+        } else if (hdr.n_tokens < 0 ||
+                   hdr.tokens_offset + (uint64_t)hdr.n_tokens * sizeof(llama_token) > hdr.state_offset ||
+                   hdr.state_offset + hdr.state_size > fv.size) {
+            bad = "Session file is truncated or corrupt";
+        } else if (hdr.n_vocab != llama_vocab_n_tokens(state->vocab) ||
+                   hdr.n_embd != llama_model_n_embd(state->model) ||
+                   hdr.n_layer != llama_model_n_layer(state->model) ||
+                   hdr.model_fingerprint != model_fingerprint(state)) {
+            bad = "Session was saved with a different model";
+        } else if (hdr.n_tokens >= state->n_ctx) {
+            bad = "Session does not fit in n_ctx";
+        }
+    }
+    if (bad) {
+        file_view_close(&fv);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(bad, -1));
+        return TCL_ERROR;
+    }
+    
+    llama_kv_self_seq_rm(state->ctx, 0, -1, -1);
+    state->kv_tokens->clear();
+    state->n_past = 0;
+    
+    if (hdr.state_size > 0 &&
+        llama_state_seq_set_data(state->ctx, fv.data + hdr.state_offset, hdr.state_size, 0) == 0) {
+        llama_kv_self_seq_rm(state->ctx, 0, -1, -1);
+        file_view_close(&fv);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Failed to restore KV state", -1));
+        return TCL_ERROR;
+    }
+    
+    const llama_token *toks = (const llama_token*)(fv.data + hdr.tokens_offset);
+    state->kv_tokens->assign(toks, toks + hdr.n_tokens);
+    state->n_past = hdr.n_tokens;
+    file_view_close(&fv);
+    
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(state->n_past));
+    return TCL_OK;
+}
+
+static int Llama_Session_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc != 4) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::session save|load handle file", -1));
+        return TCL_ERROR;
+    }
     
-    if (fmt_len < 0) {
-        for (auto ptr : allocated_strings) free(ptr);
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Template application failed", -1));
+    const char *sub = Tcl_GetString(objv[1]);
+    if (strcmp(sub, "save") != 0 && strcmp(sub, "load") != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::session save|load handle file", -1));
         return TCL_ERROR;
     }
     
-    std::vector<char> formatted(fmt_len + 1);
-    llama_chat_apply_template(tmpl.c_str(), cmsgs.data(), cmsgs.size(), true, 
-                               formatted.data(), fmt_len + 1);
+    LlamaState *state = state_from_obj(interp, objv[2]);
+    if (!state) return TCL_ERROR;
+    if (check_idle(interp, state) != TCL_OK) return TCL_ERROR;
     
-    // Liberar strings asignados
-    for (auto ptr : allocated_strings) free(ptr);
+    // Ruta nativa (~, relativas al cwd de Tcl, etc.)
+    Tcl_DString native;
+    const char *path = Tcl_TranslateFileName(interp, Tcl_GetString(objv[3]), &native);
+    if (!path) return TCL_ERROR;
+    
+    int rc = (sub[0] == 's') ? session_save(interp, state, path) : session_load(interp, state, path);
+    Tcl_DStringFree(&native);
+    return rc;
+}
 
-    std::vector<llama_token> tokens(fmt_len + 1024);
-    int n_tok = llama_tokenize(state->vocab, formatted.data(), fmt_len, 
-                                tokens.data(), tokens.size(), true, false);
+/* ----------------- LLAMA::EMBED ----------------- */
+// El contexto se crea con pooling NONE y el pooling se hace aquí, así cada
+// llamada elige mean/cls/last sin recrear el contexto.
+enum { POOL_MEAN = 0, POOL_CLS, POOL_LAST };
+
+static void embed_pool(LlamaState *state, int base, int len, int pooling, int normalize,
+                       int n_embd, float *dst, int *ok) {
+    int first = base, last = base + len - 1;
+    if (pooling == POOL_CLS) last = first;
+    else if (pooling == POOL_LAST) first = last;
     
-    if (n_tok < 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Tokenization failed", -1));
-        return TCL_ERROR;
+    memset(dst, 0, n_embd * sizeof(float));
+    for (int i = first; i <= last; i++) {
+        const float *e = llama_get_embeddings_ith(state->ctx, i);
+        if (!e) { *ok = 0; return; }
+        for (int d = 0; d < n_embd; d++) dst[d] += e[d];
     }
+    int n = last - first + 1;
+    if (n > 1) {
+        for (int d = 0; d < n_embd; d++) dst[d] /= n;
+    }
+    if (normalize) {
+        double norm = 0.0;
+        for (int d = 0; d < n_embd; d++) norm += (double)dst[d] * dst[d];
+        if (norm > 0.0) {
+            float inv = (float)(1.0 / sqrt(norm));
+            for (int d = 0; d < n_embd; d++) dst[d] *= inv;
+        }
+    }
+}
 
-    // Telemetría: medir tiempo de ingestión
-    auto t_start_eval = std::chrono::high_resolution_clock::now();
+// Empaqueta varios textos por llama_decode, uno por seq_id, hasta llenar
+// n_ubatch (los modelos no causales exigen la secuencia entera en un ubatch)
+// o agotar las secuencias. Si hay secuencias de sobra y espacio en el KV,
+// la 0 (prefijo de generate/chat) se conserva.
+static int Llama_Embed_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 3 || (objc - 3) % 2 != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::embed handle textList ?-pooling mean|cls|last? ?-normalize bool? ?-format list|float32? ?-reset bool?", -1));
+        return TCL_ERROR;
+    }
     
-    struct llama_batch batch = llama_batch_init(n_tok, 0, 1);
-    for (int i = 0; i < n_tok; i++) {
-        fill_batch(batch, tokens[i], state->n_past, (i == n_tok - 1));
-        state->n_past++;
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
+    if (check_idle(interp, state) != TCL_OK) return TCL_ERROR;
+    
+    if (!state->embeddings) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Embeddings not enabled for this handle (llama::init ... {embeddings 1})", -1));
+        return TCL_ERROR;
+    }
+    if (state->engine && (!state->engine->active.empty() || !state->engine->pending.empty())) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Batch engine has requests in flight", -1));
+        return TCL_ERROR;
+    }
+    
+    int pooling = POOL_MEAN, normalize = 0, as_bytes = 0, reset = 0;
+    for (int i = 3; i < objc; i += 2) {
+        const char *opt = Tcl_GetString(objv[i]);
+        const char *val = Tcl_GetString(objv[i+1]);
+        if (strcmp(opt, "-pooling") == 0) {
+            if (strcmp(val, "mean") == 0) pooling = POOL_MEAN;
+            else if (strcmp(val, "cls") == 0) pooling = POOL_CLS;
+            else if (strcmp(val, "last") == 0) pooling = POOL_LAST;
+            else {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid pooling \"%s\": must be mean, cls or last", val));
+                return TCL_ERROR;
+            }
+        } else if (strcmp(opt, "-normalize") == 0) {
+            if (Tcl_GetBooleanFromObj(interp, objv[i+1], &normalize) != TCL_OK) return TCL_ERROR;
+        } else if (strcmp(opt, "-reset") == 0) {
+            if (Tcl_GetBooleanFromObj(interp, objv[i+1], &reset) != TCL_OK) return TCL_ERROR;
+        } else if (strcmp(opt, "-format") == 0) {
+            if (strcmp(val, "list") == 0) as_bytes = 0;
+            else if (strcmp(val, "float32") == 0) as_bytes = 1;
+            else {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid format \"%s\": must be list or float32", val));
+                return TCL_ERROR;
+            }
+        } else {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown option \"%s\"", opt));
+            return TCL_ERROR;
+        }
     }
     
-    if (llama_decode(state->ctx, batch) != 0) {
-        llama_batch_free(batch);
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Decode failed", -1));
+    int n_texts;
+    Tcl_Obj **texts;
+    if (Tcl_ListObjGetElements(interp, objv[2], &n_texts, &texts) != TCL_OK) {
         return TCL_ERROR;
     }
+    
+    // Tokenizar todo primero: los errores salen antes de tocar el KV
+    int n_ubatch = llama_n_ubatch(state->ctx);
+    std::vector<llama_token> tokens;
+    std::vector<int> offsets(n_texts + 1, 0);
+    for (int t = 0; t < n_texts; t++) {
+        int len;
+        const char *text = Tcl_GetStringFromObj(texts[t], &len);
+        size_t at = tokens.size();
+        tokens.resize(at + len + 16);
+        int n = llama_tokenize(state->vocab, text, len, tokens.data() + at, len + 16, true, false);
+        if (n < 0) {
+            tokens.resize(at - n);
+            n = llama_tokenize(state->vocab, text, len, tokens.data() + at, -n, true, false);
+        }
+        if (n <= 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tokenization failed for text %d", t));
+            return TCL_ERROR;
+        }
+        if (n > n_ubatch) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Text %d has %d tokens, more than n_ubatch (%d)", t, n, n_ubatch));
+            return TCL_ERROR;
+        }
+        tokens.resize(at + n);
+        offsets[t + 1] = (int)tokens.size();
+    }
+    
+    // Sin secuencias libres o sin espacio hay que usar la 0: la conversación
+    // sólo se descarta si se pidió explícitamente
+    int n_seq_max = llama_n_seq_max(state->ctx);
+    llama_seq_id seq0 = 1;
+    if (n_seq_max == 1 || state->n_ctx - state->n_past < n_ubatch) {
+        if (state->n_past > 0 && !reset) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Embedding needs sequence 0 (n_seq_max 1 or not enough free context): use -reset 1 to discard the conversation", -1));
+            return TCL_ERROR;
+        }
+        llama_kv_self_seq_rm(state->ctx, 0, -1, -1);
+        state->n_past = 0;
+        state->kv_tokens->clear();
+        seq0 = 0;
+    }
+    
+    int n_embd = llama_model_n_embd(state->model);
+    std::vector<float> out((size_t)n_texts * n_embd);
+    struct llama_batch batch = llama_batch_init(n_ubatch, 0, 1);
+    
+    auto t_start = std::chrono::high_resolution_clock::now();
+    llama_set_embeddings(state->ctx, true);
+    
+    int ok = 1;
+    const char *err = NULL;
+    for (int t = 0; t < n_texts && ok; ) {
+        int first = t;
+        llama_seq_id seq = seq0;
+        batch.n_tokens = 0;
+        while (t < n_texts && seq < n_seq_max &&
+               batch.n_tokens + (offsets[t + 1] - offsets[t]) <= n_ubatch) {
+            int len = offsets[t + 1] - offsets[t];
+            for (int j = 0; j < len; j++) {
+                bool want = pooling == POOL_MEAN ||
+                            (pooling == POOL_CLS && j == 0) ||
+                            (pooling == POOL_LAST && j == len - 1);
+                fill_batch(batch, tokens[offsets[t] + j], j, want, seq);
+            }
+            t++;
+            seq++;
+        }
+        
+        if (llama_decode(state->ctx, batch) != 0) {
+            ok = 0;
+            err = "Decode failed";
+        }
+        int base = 0;
+        for (int k = first; k < t && ok; k++) {
+            int len = offsets[k + 1] - offsets[k];
+            embed_pool(state, base, len, pooling, normalize, n_embd, &out[(size_t)k * n_embd], &ok);
+            if (!ok) err = "Failed to get embeddings";
+            base += len;
+        }
+        for (llama_seq_id s = seq0; s < seq; s++) {
+            llama_kv_self_seq_rm(state->ctx, s, -1, -1);
+        }
+    }
+    
+    llama_set_embeddings(state->ctx, false);
     llama_batch_free(batch);
+    auto t_end = std::chrono::high_resolution_clock::now();
     
-    auto t_end_eval = std::chrono::high_resolution_clock::now();
-    state->t_eval_ms = std::chrono::duration<double, std::milli>(t_end_eval - t_start_eval).count();
-    state->n_eval = n_tok;
-
-    return run_inference(interp, state, cb_name, stop_ids);
+    if (!ok) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(err, -1));
+        return TCL_ERROR;
+    }
+    
+    state->t_embed_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+    state->n_embed_texts = n_texts;
+    state->n_embed_tokens = (int)tokens.size();
+    state->t_embed_ms_total += state->t_embed_ms;
+    state->n_embed_texts_total += n_texts;
+    
+    if (as_bytes) {
+        // Filas contiguas de n_embd float32 en el orden nativo de la máquina
+        Tcl_SetObjResult(interp, Tcl_NewByteArrayObj((const unsigned char*)out.data(),
+                                                     (int)(out.size() * sizeof(float))));
+        return TCL_OK;
+    }
+    
+    Tcl_Obj *res = Tcl_NewListObj(0, NULL);
+    std::vector<Tcl_Obj*> row(n_embd);
+    for (int t = 0; t < n_texts; t++) {
+        for (int d = 0; d < n_embd; d++) {
+            row[d] = Tcl_NewDoubleObj(out[(size_t)t * n_embd + d]);
+        }
+        Tcl_ListObjAppendElement(interp, res, Tcl_NewListObj(n_embd, row.data()));
+    }
+    Tcl_SetObjResult(interp, res);
+    return TCL_OK;
 }
 
 /* ----------------- LLAMA::DETOKENIZE (v7.0) ----------------- */
@@ -636,12 +3998,8 @@ static int Llama_Detokenize_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl
         return TCL_ERROR;
     }
     
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
-        return TCL_ERROR;
-    }
-    LlamaState *state = (LlamaState*)info.objClientData;
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
     
     int n_tokens;
     Tcl_Obj **token_elems;
@@ -650,6 +4008,8 @@ static int Llama_Detokenize_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl
         return TCL_ERROR;
     }
     
+    piece_table_ensure(state->pieces);
+    
     Tcl_DString result;
     Tcl_DStringInit(&result);
     
@@ -661,12 +4021,9 @@ static int Llama_Detokenize_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl
             return TCL_ERROR;
         }
         
-        char piece[256];
-        int n = llama_token_to_piece(state->vocab, token_id, piece, sizeof(piece) - 1, 0, false);
-        if (n > 0) {
-            piece[n] = 0;
-            Tcl_DStringAppend(&result, piece, n);
-        }
+        int n;
+        const char *piece = piece_text(state->pieces, token_id, &n);
+        if (n > 0) Tcl_DStringAppend(&result, piece, n);
     }
     
     Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&result), -1));
@@ -695,18 +4052,24 @@ static int Llama_Version_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Ob
 }
 
 /* ----------------- LLAMA::INFO - Información completa (v6.9 + v7.0) ----------------- */
+// Bytes del KV cache: por capa y por celda, una fila K y una V de n_embd_gqa
+// elementos (cabezas KV × dimensión de cabeza) en el tipo elegido en init
+static Tcl_WideInt kv_cache_bytes(LlamaState *state) {
+    int n_head = llama_model_n_head(state->model);
+    if (n_head <= 0) return 0;
+    int64_t n_embd_gqa = (int64_t)llama_model_n_embd(state->model) / n_head * llama_model_n_head_kv(state->model);
+    size_t per_cell = ggml_row_size(state->type_k, n_embd_gqa) + ggml_row_size(state->type_v, n_embd_gqa);
+    return (Tcl_WideInt)per_cell * llama_model_n_layer(state->model) * llama_n_ctx(state->ctx);
+}
+
 static int Llama_Info_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     if (objc != 2) {
         Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::info handle", -1));
         return TCL_ERROR;
     }
     
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
-        return TCL_ERROR;
-    }
-    LlamaState *state = (LlamaState*)info.objClientData;
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
     
     Tcl_Obj *dict = Tcl_NewDictObj();
     
@@ -719,6 +4082,28 @@ static int Llama_Info_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *
                    Tcl_NewIntObj(state->n_past));
     Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_ctx_available", -1),
                    Tcl_NewIntObj(state->n_ctx - state->n_past));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_batch", -1),
+                   Tcl_NewIntObj(llama_n_batch(state->ctx)));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_ubatch", -1),
+                   Tcl_NewIntObj(llama_n_ubatch(state->ctx)));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_threads", -1),
+                   Tcl_NewIntObj(llama_n_threads(state->ctx)));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_threads_batch", -1),
+                   Tcl_NewIntObj(llama_n_threads_batch(state->ctx)));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("type_k", -1),
+                   Tcl_NewStringObj(ggml_type_name(state->type_k), -1));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("type_v", -1),
+                   Tcl_NewStringObj(ggml_type_name(state->type_v), -1));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("flash_attn", -1),
+                   Tcl_NewIntObj(state->flash_attn));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("offload_kqv", -1),
+                   Tcl_NewIntObj(state->offload_kqv));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("kv_cache_bytes", -1),
+                   Tcl_NewWideIntObj(kv_cache_bytes(state)));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("ctx_shift", -1),
+                   Tcl_NewIntObj(state->ctx_shift));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_keep", -1),
+                   Tcl_NewIntObj(state->n_keep));
     
     // Información del modelo (v6.9)
     char model_desc[256];
@@ -726,86 +4111,672 @@ static int Llama_Info_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *
     Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("model_desc", -1),
                    Tcl_NewStringObj(model_desc, -1));
     
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_embd", -1),
+                   Tcl_NewIntObj(llama_model_n_embd(state->model)));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("embeddings", -1),
+                   Tcl_NewIntObj(state->embeddings));
+    
     Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("n_vocab", -1),
                    Tcl_NewIntObj(llama_vocab_n_tokens(state->vocab)));
     
-    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("model_size", -1),
-                   Tcl_NewWideIntObj(llama_model_size(state->model)));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("model_size", -1),
+                   Tcl_NewWideIntObj(llama_model_size(state->model)));
+    
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("model_n_params", -1),
+                   Tcl_NewWideIntObj(llama_model_n_params(state->model)));
+    
+    // Parámetros de sampling actuales (v6.9)
+    Tcl_Obj *sampling = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("temperature", -1),
+                   Tcl_NewDoubleObj(state->temp));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("top_k", -1),
+                   Tcl_NewIntObj(state->top_k));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("top_p", -1),
+                   Tcl_NewDoubleObj(state->top_p));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("min_p", -1),
+                   Tcl_NewDoubleObj(state->min_p));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("repeat_penalty", -1),
+                   Tcl_NewDoubleObj(state->repeat_penalty));
+    
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("cache_hits", -1),
+                   Tcl_NewWideIntObj(state->n_sampler_hits));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("cache_builds", -1),
+                   Tcl_NewWideIntObj(state->n_sampler_builds));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("grammar_cache_hits", -1),
+                   Tcl_NewWideIntObj(state->n_grammar_hits));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("grammar_compiles", -1),
+                   Tcl_NewWideIntObj(state->n_grammar_compiles));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("bias_cache_hits", -1),
+                   Tcl_NewWideIntObj(state->n_bias_hits));
+    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("bias_compiles", -1),
+                   Tcl_NewWideIntObj(state->n_bias_compiles));
+    
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("sampling", -1), sampling);
+    
+    // Telemetría (v7.0) - Con protección contra división por cero
+    Tcl_Obj *telemetry = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("t_warmup_ms", -1),
+                   Tcl_NewDoubleObj(state->t_warmup_ms));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("t_eval_ms", -1),
+                   Tcl_NewDoubleObj(state->t_eval_ms));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("t_gen_ms", -1),
+                   Tcl_NewDoubleObj(state->t_gen_ms));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_eval", -1),
+                   Tcl_NewIntObj(state->n_eval));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_gen", -1),
+                   Tcl_NewIntObj(state->n_gen));
+    
+    // Reutilización de prefijo KV: última llamada y acumulado
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_reused", -1),
+                   Tcl_NewIntObj(state->n_reused));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_reused_total", -1),
+                   Tcl_NewWideIntObj(state->n_reused_total));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_eval_total", -1),
+                   Tcl_NewWideIntObj(state->n_eval_total));
+    
+    Tcl_WideInt n_prompt_total = state->n_reused_total + state->n_eval_total;
+    double reuse_ratio = (n_prompt_total > 0)
+        ? ((double)state->n_reused_total / (double)n_prompt_total)
+        : 0.0;
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("reuse_ratio", -1),
+                   Tcl_NewDoubleObj(reuse_ratio));
+    
+    // TPS con protección contra división por cero
+    double eval_tps = (state->t_eval_ms > 0.0) 
+        ? (state->n_eval / (state->t_eval_ms / 1000.0)) 
+        : 0.0;
+    double gen_tps = (state->t_gen_ms > 0.0) 
+        ? (state->n_gen / (state->t_gen_ms / 1000.0)) 
+        : 0.0;
+    
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("eval_tps", -1),
+                   Tcl_NewDoubleObj(eval_tps));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("gen_tps", -1),
+                   Tcl_NewDoubleObj(gen_tps));
+    
+    // Asignaciones de heap por token generado (debería ser ~0)
+    double allocs_per_token = (state->n_gen > 0)
+        ? ((double)state->n_gen_allocs / (double)state->n_gen)
+        : 0.0;
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("allocs_per_token", -1),
+                   Tcl_NewDoubleObj(allocs_per_token));
+    
+    // Context shift: última llamada y acumulados
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("ctx_shifts", -1),
+                   Tcl_NewIntObj(state->n_ctx_shifts));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("ctx_shifts_total", -1),
+                   Tcl_NewWideIntObj(state->n_ctx_shifts_total));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("ctx_discarded_total", -1),
+                   Tcl_NewWideIntObj(state->n_ctx_discarded_total));
+    
+    // Decodificación especulativa (-draft / -lookup): aceptación y ganancia estimada
+    static const char *spec_mode_names[] = { "none", "draft", "lookup" };
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("spec_mode", -1),
+                   Tcl_NewStringObj(spec_mode_names[state->spec_mode], -1));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("draft_disabled", -1),
+                   Tcl_NewIntObj(state->draft_disabled));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_drafted", -1),
+                   Tcl_NewIntObj(state->n_drafted));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_accepted", -1),
+                   Tcl_NewIntObj(state->n_accepted));
+    double accept_rate = (state->n_drafted > 0)
+        ? ((double)state->n_accepted / (double)state->n_drafted)
+        : 0.0;
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("accept_rate", -1),
+                   Tcl_NewDoubleObj(accept_rate));
+    double accept_rate_total = (state->n_drafted_total > 0)
+        ? ((double)state->n_accepted_total / (double)state->n_drafted_total)
+        : 0.0;
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("accept_rate_total", -1),
+                   Tcl_NewDoubleObj(accept_rate_total));
+    double tokens_per_step = (state->n_spec_steps > 0)
+        ? ((double)state->n_gen / (double)state->n_spec_steps)
+        : 0.0;
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("tokens_per_step", -1),
+                   Tcl_NewDoubleObj(tokens_per_step));
+    // gen_tps de la última llamada especulativa contra la última sin borrador
+    double spec_gain = (state->n_spec_steps > 0 && state->gen_tps_plain > 0.0)
+        ? (gen_tps / state->gen_tps_plain)
+        : 0.0;
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("spec_gain", -1),
+                   Tcl_NewDoubleObj(spec_gain));
+    
+    // Embeddings: última llamada y acumulado (textos/s)
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_embed_texts", -1),
+                   Tcl_NewIntObj(state->n_embed_texts));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_embed_tokens", -1),
+                   Tcl_NewIntObj(state->n_embed_tokens));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("t_embed_ms", -1),
+                   Tcl_NewDoubleObj(state->t_embed_ms));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("embed_texts_per_sec", -1),
+                   Tcl_NewDoubleObj(state->t_embed_ms > 0 ? state->n_embed_texts * 1000.0 / state->t_embed_ms : 0.0));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_embed_texts_total", -1),
+                   Tcl_NewWideIntObj(state->n_embed_texts_total));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("embed_texts_per_sec_total", -1),
+                   Tcl_NewDoubleObj(state->t_embed_ms_total > 0 ? state->n_embed_texts_total * 1000.0 / state->t_embed_ms_total : 0.0));
+    
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("telemetry", -1), telemetry);
+    
+    Tcl_SetObjResult(interp, dict);
+    return TCL_OK;
+}
+
+/* ----------------- LLAMA::PROFILE - Perfiles de muestreo ----------------- */
+// Un perfil parte de los valores por defecto y guarda el dict de opciones ya
+// resuelto; -profile name lo aplica sin volver a interpretar el dict.
+static int Llama_Profile_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::profile define|get|delete|list handle ?name? ?options?", -1));
+        return TCL_ERROR;
+    }
+    
+    const char *sub = Tcl_GetString(objv[1]);
+    LlamaState *state = state_from_obj(interp, objv[2]);
+    if (!state) return TCL_ERROR;
+    
+    if (strcmp(sub, "list") == 0) {
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+        for (auto &kv : *state->profiles) {
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(kv.first.c_str(), -1));
+        }
+        Tcl_SetObjResult(interp, list);
+        return TCL_OK;
+    }
+    
+    if (strcmp(sub, "define") == 0) {
+        if (objc != 5) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::profile define handle name options", -1));
+            return TCL_ERROR;
+        }
+        LlamaState defaults;
+        memset(&defaults, 0, sizeof(defaults));
+        set_defaults(&defaults);
+        SamplerProfile prof;
+        sampler_key_from_state(&defaults, &prof.key);
+        prof.n_predict = defaults.n_predict;
+        if (parse_sampler_options(interp, objv[4], &prof) != TCL_OK) return TCL_ERROR;
+        (*state->profiles)[Tcl_GetString(objv[3])] = prof;
+        Tcl_SetObjResult(interp, objv[3]);
+        return TCL_OK;
+    }
+    
+    if (objc != 4) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Usage: llama::profile %s handle name", sub));
+        return TCL_ERROR;
+    }
+    auto it = state->profiles->find(Tcl_GetString(objv[3]));
+    if (it == state->profiles->end()) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown sampling profile \"%s\"", Tcl_GetString(objv[3])));
+        return TCL_ERROR;
+    }
+    
+    if (strcmp(sub, "delete") == 0) {
+        state->profiles->erase(it);
+        return TCL_OK;
+    }
+    
+    if (strcmp(sub, "get") == 0) {
+        const SamplerProfile &prof = it->second;
+        Tcl_Obj *dict = Tcl_NewDictObj();
+        for (const SamplerOptionDef *def = sampler_option_defs; def->name; def++) {
+            const char *src = (const char*)&prof + def->offset;
+            Tcl_DictObjPut(interp, dict, Tcl_NewStringObj(def->name, -1),
+                           def->is_float ? Tcl_NewDoubleObj(*(const float*)src)
+                                         : Tcl_NewIntObj(*(const int32_t*)src));
+        }
+        Tcl_SetObjResult(interp, dict);
+        return TCL_OK;
+    }
+    
+    Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::profile define|get|delete|list handle ?name? ?options?", -1));
+    return TCL_ERROR;
+}
+
+/* ----------------- LLAMA::VERBOSE - Control de verbosidad ----------------- */
+static int Llama_Verbose_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 2 || objc > 3) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::verbose handle ?0|1?", -1));
+        return TCL_ERROR;
+    }
+    
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
+    
+    if (objc == 3) {
+        // Set verbose
+        int verbose;
+        if (Tcl_GetBooleanFromObj(interp, objv[2], &verbose) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        state->verbose = verbose;
+    }
+    
+    // Return current verbose state
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(state->verbose));
+    return TCL_OK;
+}
+
+/* ----------------- LLAMA::THREADS - Hilos de cómputo ----------------- */
+// Generar un token está limitado por el ancho de banda de memoria y suele ir
+// mejor con menos hilos que la ingestión del prompt, que escala con los núcleos.
+#define THREADS_MAX 512
+
+static int Llama_Threads_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 2 || objc > 4) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::threads handle ?n_threads? ?n_threads_batch?", -1));
+        return TCL_ERROR;
+    }
+    
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
+    
+    if (objc >= 3) {
+        if (check_idle(interp, state) != TCL_OK) return TCL_ERROR;
+        int n_gen = llama_n_threads(state->ctx);
+        int n_batch = llama_n_threads_batch(state->ctx);
+        if (Tcl_GetIntFromObj(interp, objv[2], &n_gen) != TCL_OK) return TCL_ERROR;
+        if (objc == 4 && Tcl_GetIntFromObj(interp, objv[3], &n_batch) != TCL_OK) return TCL_ERROR;
+        if (n_gen < 1 || n_gen > THREADS_MAX || n_batch < 1 || n_batch > THREADS_MAX) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Thread counts must be between 1 and %d", THREADS_MAX));
+            return TCL_ERROR;
+        }
+        llama_set_n_threads(state->ctx, n_gen, n_batch);
+    }
+    
+    Tcl_Obj *res = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, res, Tcl_NewStringObj("n_threads", -1),
+                   Tcl_NewIntObj(llama_n_threads(state->ctx)));
+    Tcl_DictObjPut(interp, res, Tcl_NewStringObj("n_threads_batch", -1),
+                   Tcl_NewIntObj(llama_n_threads_batch(state->ctx)));
+    Tcl_SetObjResult(interp, res);
+    return TCL_OK;
+}
+
+/* ----------------- LLAMA::BENCH ----------------- */
+// Pruebas sintéticas al estilo llama-bench. ppN decodifica N tokens con
+// decode_chunks (los mismos bloques de n_batch que un prompt real); tgN genera
+// N tokens con decodes de un token sobre tok_batch, como generate_loop. Cada
+// configuración corre una vez de calentamiento y luego -reps veces desde la
+// secuencia 0 vacía. Los tokens son aleatorios con semilla fija, así los
+// números son comparables entre builds y hosts. Al terminar la secuencia 0
+// queda vacía y los hilos vuelven a su valor previo.
+
+#define BENCH_REPS_MAX 1000
+
+typedef struct {
+    int     tg;         // 0 = pp, 1 = tg
+    int     n_tokens;
+    int     n_threads;
+    double  ms_mean;
+    double  tps_mean;
+    double  tps_stddev;
+} BenchResult;
+
+static int parse_bench_list(Tcl_Interp *interp, Tcl_Obj *obj, const char *what, int max,
+                            std::vector<int> &out) {
+    int n;
+    Tcl_Obj **elems;
+    if (Tcl_ListObjGetElements(interp, obj, &n, &elems) != TCL_OK) return TCL_ERROR;
+    out.clear();
+    for (int k = 0; k < n; k++) {
+        int v;
+        if (Tcl_GetIntFromObj(interp, elems[k], &v) != TCL_OK) return TCL_ERROR;
+        if (v < 1 || v > max) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s values must be between 1 and %d", what, max));
+            return TCL_ERROR;
+        }
+        out.push_back(v);
+    }
+    return TCL_OK;
+}
+
+static void bench_clear(LlamaState *state) {
+    llama_kv_self_seq_rm(state->ctx, 0, -1, -1);
+    state->n_past = 0;
+    state->kv_tokens->clear();
+}
+
+// Una repetición; devuelve los milisegundos o -1 si falló el decode
+static double bench_run_once(LlamaState *state, int tg, const std::vector<llama_token> &tokens, int n) {
+    bench_clear(state);
+    auto t_start = std::chrono::high_resolution_clock::now();
+    if (!tg) {
+        if (decode_chunks(state, tokens.data(), n, NULL) != INGEST_OK) return -1.0;
+    } else {
+        struct llama_batch &b = state->tok_batch;
+        for (int i = 0; i < n; i++) {
+            b.n_tokens = 0;
+            fill_batch(b, tokens[i], state->n_past, true);
+            state->n_past++;
+            if (llama_decode(state->ctx, b) != 0) return -1.0;
+        }
+    }
+    llama_synchronize(state->ctx);
+    auto t_end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(t_end - t_start).count();
+}
+
+static void json_field(JsonValue &obj, const char *key, JsonValue::Type type, const std::string &text) {
+    std::pair<std::string, JsonValue> m;
+    m.first = key;
+    m.second.type = type;
+    m.second.str = text;
+    obj.members.push_back(m);
+}
+
+static void json_field_num(JsonValue &obj, const char *key, double value) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.6g", value);
+    json_field(obj, key, JsonValue::J_NUMBER, buf);
+}
+
+static void json_field_int(JsonValue &obj, const char *key, long long value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", value);
+    json_field(obj, key, JsonValue::J_NUMBER, buf);
+}
+
+static int Llama_Bench_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 2 || (objc % 2) != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::bench handle ?-pp list? ?-tg list? ?-threads list? ?-reps n? ?-format dict|json? ?-reset bool?", -1));
+        return TCL_ERROR;
+    }
+    
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
+    if (check_idle(interp, state) != TCL_OK) return TCL_ERROR;
+    
+    int n_threads_prev = llama_n_threads(state->ctx);
+    int n_threads_batch_prev = llama_n_threads_batch(state->ctx);
+    std::vector<int> pp(1, 512), tg(1, 128), threads(1, n_threads_prev);
+    int reps = 5;
+    int json = 0;
+    int reset = 0;
+    
+    for (int i = 2; i < objc; i += 2) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (strcmp(opt, "-pp") == 0) {
+            if (parse_bench_list(interp, objv[i+1], "-pp", state->n_ctx - 1, pp) != TCL_OK) return TCL_ERROR;
+        } else if (strcmp(opt, "-tg") == 0) {
+            if (parse_bench_list(interp, objv[i+1], "-tg", state->n_ctx - 1, tg) != TCL_OK) return TCL_ERROR;
+        } else if (strcmp(opt, "-threads") == 0) {
+            if (parse_bench_list(interp, objv[i+1], "-threads", THREADS_MAX, threads) != TCL_OK) return TCL_ERROR;
+            if (threads.empty()) threads.push_back(n_threads_prev);
+        } else if (strcmp(opt, "-reps") == 0) {
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &reps) != TCL_OK) return TCL_ERROR;
+            if (reps < 1 || reps > BENCH_REPS_MAX) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("-reps must be between 1 and %d", BENCH_REPS_MAX));
+                return TCL_ERROR;
+            }
+        } else if (strcmp(opt, "-reset") == 0) {
+            if (Tcl_GetBooleanFromObj(interp, objv[i+1], &reset) != TCL_OK) return TCL_ERROR;
+        } else if (strcmp(opt, "-format") == 0) {
+            const char *fmt = Tcl_GetString(objv[i+1]);
+            if (strcmp(fmt, "json") == 0) json = 1;
+            else if (strcmp(fmt, "dict") == 0) json = 0;
+            else {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown format \"%s\": must be dict or json", fmt));
+                return TCL_ERROR;
+            }
+        } else {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown option \"%s\"", opt));
+            return TCL_ERROR;
+        }
+    }
+    
+    // Cada corrida vacía la secuencia 0: no descartar una conversación sin pedirlo
+    if (state->n_past > 0 && !reset) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("llama::bench clears sequence 0: use -reset 1 to discard the conversation", -1));
+        return TCL_ERROR;
+    }
+    // Tokens sintéticos: misma secuencia en todas las corridas
+    int n_max = 1;
+    for (int n : pp) n_max = std::max(n_max, n);
+    for (int n : tg) n_max = std::max(n_max, n);
+    int n_vocab = llama_vocab_n_tokens(state->vocab);
+    std::vector<llama_token> tokens(n_max);
+    uint32_t rng = 0x12345678u;
+    for (int i = 0; i < n_max; i++) {
+        rng = rng * 1664525u + 1013904223u;
+        tokens[i] = (llama_token)((rng >> 8) % (uint32_t)n_vocab);
+    }
+    
+    std::vector<BenchResult> results;
+    int failed = 0;
+    for (int t : threads) {
+        llama_set_n_threads(state->ctx, t, t);
+        for (int kind = 0; kind < 2 && !failed; kind++) {
+            for (int n : (kind ? tg : pp)) {
+                std::vector<double> tps;
+                double ms_sum = 0.0;
+                for (int r = -1; r < reps; r++) {
+                    double ms = bench_run_once(state, kind, tokens, n);
+                    if (ms < 0.0) { failed = 1; break; }
+                    if (r < 0) continue;
+                    ms_sum += ms;
+                    tps.push_back(ms > 0.0 ? n * 1000.0 / ms : 0.0);
+                }
+                if (failed) break;
+                
+                BenchResult res;
+                res.tg = kind;
+                res.n_tokens = n;
+                res.n_threads = t;
+                double sum = 0.0, sq = 0.0;
+                for (double v : tps) sum += v;
+                res.tps_mean = sum / tps.size();
+                for (double v : tps) sq += (v - res.tps_mean) * (v - res.tps_mean);
+                res.tps_stddev = (tps.size() > 1) ? sqrt(sq / (tps.size() - 1)) : 0.0;
+                res.ms_mean = ms_sum / tps.size();
+                results.push_back(res);
+            }
+        }
+        if (failed) break;
+    }
+    llama_set_n_threads(state->ctx, n_threads_prev, n_threads_batch_prev);
+    bench_clear(state);
     
-    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("model_n_params", -1),
-                   Tcl_NewWideIntObj(llama_model_n_params(state->model)));
+    if (failed) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Decode failed during benchmark", -1));
+        return TCL_ERROR;
+    }
     
-    // Parámetros de sampling actuales (v6.9)
-    Tcl_Obj *sampling = Tcl_NewDictObj();
-    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("temperature", -1),
-                   Tcl_NewDoubleObj(state->temp));
-    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("top_k", -1),
-                   Tcl_NewIntObj(state->top_k));
-    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("top_p", -1),
-                   Tcl_NewDoubleObj(state->top_p));
-    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("min_p", -1),
-                   Tcl_NewDoubleObj(state->min_p));
-    Tcl_DictObjPut(interp, sampling, Tcl_NewStringObj("repeat_penalty", -1),
-                   Tcl_NewDoubleObj(state->repeat_penalty));
+    if (json) {
+        // Una línea JSON por configuración, con lo necesario para comparar hosts
+        char desc[256];
+        llama_model_desc(state->model, desc, sizeof(desc));
+        std::string out;
+        for (const BenchResult &res : results) {
+            JsonValue obj;
+            obj.type = JsonValue::J_OBJECT;
+            json_field(obj, "model", JsonValue::J_STRING, desc);
+            json_field_int(obj, "model_size", (long long)llama_model_size(state->model));
+            json_field_int(obj, "n_batch", llama_n_batch(state->ctx));
+            json_field_int(obj, "n_ubatch", llama_n_ubatch(state->ctx));
+            json_field(obj, "type_k", JsonValue::J_STRING, ggml_type_name(state->type_k));
+            json_field(obj, "type_v", JsonValue::J_STRING, ggml_type_name(state->type_v));
+            json_field(obj, "flash_attn", JsonValue::J_BOOL, state->flash_attn ? "true" : "false");
+            json_field(obj, "test", JsonValue::J_STRING, res.tg ? "tg" : "pp");
+            json_field_int(obj, "n_tokens", res.n_tokens);
+            json_field_int(obj, "n_threads", res.n_threads);
+            json_field_int(obj, "reps", reps);
+            json_field_num(obj, "ms_mean", res.ms_mean);
+            json_field_num(obj, "tps_mean", res.tps_mean);
+            json_field_num(obj, "tps_stddev", res.tps_stddev);
+            json_dump(obj, out);
+            out += '\n';
+        }
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(out.c_str(), (int)out.size()));
+        return TCL_OK;
+    }
     
-    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("sampling", -1), sampling);
+    // Clave "pp512/t8" -> {test pp n_tokens 512 n_threads 8 ...}
+    Tcl_Obj *dict = Tcl_NewDictObj();
+    for (const BenchResult &res : results) {
+        Tcl_Obj *entry = Tcl_NewDictObj();
+        Tcl_DictObjPut(interp, entry, Tcl_NewStringObj("test", -1), Tcl_NewStringObj(res.tg ? "tg" : "pp", -1));
+        Tcl_DictObjPut(interp, entry, Tcl_NewStringObj("n_tokens", -1), Tcl_NewIntObj(res.n_tokens));
+        Tcl_DictObjPut(interp, entry, Tcl_NewStringObj("n_threads", -1), Tcl_NewIntObj(res.n_threads));
+        Tcl_DictObjPut(interp, entry, Tcl_NewStringObj("reps", -1), Tcl_NewIntObj(reps));
+        Tcl_DictObjPut(interp, entry, Tcl_NewStringObj("ms_mean", -1), Tcl_NewDoubleObj(res.ms_mean));
+        Tcl_DictObjPut(interp, entry, Tcl_NewStringObj("tps_mean", -1), Tcl_NewDoubleObj(res.tps_mean));
+        Tcl_DictObjPut(interp, entry, Tcl_NewStringObj("tps_stddev", -1), Tcl_NewDoubleObj(res.tps_stddev));
+        Tcl_DictObjPut(interp, dict, Tcl_ObjPrintf("%s%d/t%d", res.tg ? "tg" : "pp", res.n_tokens, res.n_threads), entry);
+    }
+    Tcl_SetObjResult(interp, dict);
+    return TCL_OK;
+}
+
+/* ----------------- LLAMA::STATS ----------------- */
+// Percentiles de los histogramas de latencia. El valor es el centro del bucket
+// donde cae el rango pedido, acotado por el máximo observado.
+static double lat_bucket_low(int idx) {
+    if (idx < 8) return idx;
+    int msb = idx / 8 + 2;
+    return (double)((8u + (uint32_t)(idx % 8)) << (msb - 3));
+}
+
+static double lat_percentile_us(const LatencyHist *h, double q) {
+    if (h->n == 0) return 0.0;
+    Tcl_WideInt rank = (Tcl_WideInt)ceil(q * h->n);
+    if (rank < 1) rank = 1;
+    Tcl_WideInt seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            double width = (i < 8) ? 0.0 : lat_bucket_low(i) / 8.0;
+            return std::min(lat_bucket_low(i) + width / 2.0, h->max_us);
+        }
+    }
+    return h->max_us;
+}
+
+static Tcl_Obj *lat_hist_dict(Tcl_Interp *interp, const LatencyHist *h) {
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj(h->n));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("mean_ms", -1),
+                   Tcl_NewDoubleObj(h->n > 0 ? h->sum_us / h->n / 1000.0 : 0.0));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("p50_ms", -1), Tcl_NewDoubleObj(lat_percentile_us(h, 0.50) / 1000.0));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("p90_ms", -1), Tcl_NewDoubleObj(lat_percentile_us(h, 0.90) / 1000.0));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("p99_ms", -1), Tcl_NewDoubleObj(lat_percentile_us(h, 0.99) / 1000.0));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("max_ms", -1), Tcl_NewDoubleObj(h->max_us / 1000.0));
+    return d;
+}
+
+static int Llama_Stats_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc != 2 && objc != 4) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::stats handle ?-reset bool?", -1));
+        return TCL_ERROR;
+    }
     
-    // Telemetría (v7.0) - Con protección contra división por cero
-    Tcl_Obj *telemetry = Tcl_NewDictObj();
-    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("t_eval_ms", -1),
-                   Tcl_NewDoubleObj(state->t_eval_ms));
-    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("t_gen_ms", -1),
-                   Tcl_NewDoubleObj(state->t_gen_ms));
-    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_eval", -1),
-                   Tcl_NewIntObj(state->n_eval));
-    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_gen", -1),
-                   Tcl_NewIntObj(state->n_gen));
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
     
-    // TPS con protección contra división por cero
-    double eval_tps = (state->t_eval_ms > 0.0) 
-        ? (state->n_eval / (state->t_eval_ms / 1000.0)) 
-        : 0.0;
-    double gen_tps = (state->t_gen_ms > 0.0) 
-        ? (state->n_gen / (state->t_gen_ms / 1000.0)) 
-        : 0.0;
+    int reset = 0;
+    if (objc == 4) {
+        if (strcmp(Tcl_GetString(objv[2]), "-reset") != 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::stats handle ?-reset bool?", -1));
+            return TCL_ERROR;
+        }
+        if (Tcl_GetBooleanFromObj(interp, objv[3], &reset) != TCL_OK) return TCL_ERROR;
+        // Un hilo -async podría estar escribiendo los contadores
+        if (reset && check_idle(interp, state) != TCL_OK) return TCL_ERROR;
+    }
     
-    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("eval_tps", -1),
-                   Tcl_NewDoubleObj(eval_tps));
-    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("gen_tps", -1),
-                   Tcl_NewDoubleObj(gen_tps));
+    static const char *const names[LAT_COUNT] = { "ttft", "inter_token", "sample", "decode", "callback" };
+    Tcl_Obj *dict = Tcl_NewDictObj();
+    for (int k = 0; k < LAT_COUNT; k++) {
+        Tcl_DictObjPut(interp, dict, Tcl_NewStringObj(names[k], -1), lat_hist_dict(interp, &state->lat[k]));
+    }
     
-    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("telemetry", -1), telemetry);
+    // Se devuelve lo acumulado hasta aquí y luego se vacía: útil para muestreo periódico
+    if (reset) memset(state->lat, 0, sizeof(state->lat));
     
     Tcl_SetObjResult(interp, dict);
     return TCL_OK;
 }
 
-/* ----------------- LLAMA::VERBOSE - Control de verbosidad ----------------- */
-static int Llama_Verbose_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
-    if (objc < 2 || objc > 3) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::verbose handle ?0|1?", -1));
-        return TCL_ERROR;
-    }
+/* ----------------- LLAMA::TRACE ----------------- */
+// llama::trace start file | llama::trace stop -> {events N dropped M}
+static int Llama_Trace_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    const char *sub = (objc >= 2) ? Tcl_GetString(objv[1]) : "";
     
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
-        return TCL_ERROR;
+    if (strcmp(sub, "start") == 0 && objc == 3) {
+        if (trace_enabled()) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Trace already running", -1));
+            return TCL_ERROR;
+        }
+        Tcl_DString native;
+        const char *path = Tcl_TranslateFileName(interp, Tcl_GetString(objv[2]), &native);
+        if (!path) return TCL_ERROR;
+        FILE *f = fopen(path, "w");
+        Tcl_DStringFree(&native);
+        if (!f) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Cannot open trace file \"%s\"", Tcl_GetString(objv[2])));
+            return TCL_ERROR;
+        }
+        
+        Tcl_MutexLock(&trace_mutex);
+        if (!trace_ring) {
+            trace_ring = new TraceSlot[TRACE_RING_SIZE];
+            for (uint64_t i = 0; i < TRACE_RING_SIZE; i++) trace_ring[i].seq.store(i);
+        }
+        trace_drain();  // Restos de una sesión anterior (trace_file aún NULL)
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+        trace_file = f;
+        trace_t0 = lat_now();
+        trace_written = 0;
+        trace_dropped.store(0);
+        trace_writer_stop.store(0);
+        Tcl_MutexUnlock(&trace_mutex);
+        
+        if (Tcl_CreateThread(&trace_writer, trace_writer_proc, NULL, TCL_THREAD_STACK_DEFAULT,
+                             TCL_THREAD_JOINABLE) != TCL_OK) {
+            Tcl_MutexLock(&trace_mutex);
+            trace_file = NULL;
+            Tcl_MutexUnlock(&trace_mutex);
+            fclose(f);
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Failed to create trace writer thread", -1));
+            return TCL_ERROR;
+        }
+        trace_on.store(1);
+        return TCL_OK;
     }
-    LlamaState *state = (LlamaState*)info.objClientData;
     
-    if (objc == 3) {
-        // Set verbose
-        int verbose;
-        if (Tcl_GetBooleanFromObj(interp, objv[2], &verbose) != TCL_OK) {
+    if (strcmp(sub, "stop") == 0 && objc == 2) {
+        if (!trace_enabled()) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Trace is not running", -1));
             return TCL_ERROR;
         }
-        state->verbose = verbose;
+        trace_on.store(0);
+        trace_writer_stop.store(1);
+        int thread_rc;
+        Tcl_JoinThread(trace_writer, &thread_rc);
+        
+        Tcl_MutexLock(&trace_mutex);
+        trace_drain();
+        uint64_t dropped = trace_dropped.load();
+        fprintf(trace_file, "%s{\"name\":\"trace_dropped\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":%.3f,"
+                "\"args\":{\"events\":%llu}}\n]}\n",
+                trace_written ? ",\n" : "", (lat_now() - trace_t0) / 1000.0, (unsigned long long)dropped);
+        int rc = fclose(trace_file);
+        trace_file = NULL;
+        uint64_t written = trace_written;
+        Tcl_MutexUnlock(&trace_mutex);
+        
+        if (rc != 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Error writing trace file", -1));
+            return TCL_ERROR;
+        }
+        Tcl_Obj *res = Tcl_NewDictObj();
+        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("events", -1), Tcl_NewWideIntObj((Tcl_WideInt)written));
+        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("dropped", -1), Tcl_NewWideIntObj((Tcl_WideInt)dropped));
+        Tcl_SetObjResult(interp, res);
+        return TCL_OK;
     }
     
-    // Return current verbose state
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(state->verbose));
-    return TCL_OK;
+    Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::trace start file | llama::trace stop", -1));
+    return TCL_ERROR;
 }
 
 /* ----------------- DIAGNÓSTICO: LLAMA::GET_CONTEXT ----------------- */
@@ -815,12 +4786,8 @@ static int Llama_GetContext_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl
         return TCL_ERROR;
     }
     
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
-        return TCL_ERROR;
-    }
-    LlamaState *state = (LlamaState*)info.objClientData;
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
     
     Tcl_SetObjResult(interp, Tcl_NewIntObj(state->n_past));
     return TCL_OK;
@@ -833,12 +4800,8 @@ static int Llama_Tokenize_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_O
         return TCL_ERROR;
     }
     
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
-        return TCL_ERROR;
-    }
-    LlamaState *state = (LlamaState*)info.objClientData;
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
     
     const char *text = Tcl_GetString(objv[2]);
     std::vector<llama_token> tokens(strlen(text) + 256);
@@ -863,78 +4826,418 @@ static int Llama_ClearCache_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl
         return TCL_ERROR;
     }
     
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
-        return TCL_ERROR;
-    }
-    LlamaState *state = (LlamaState*)info.objClientData;
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
+    if (check_idle(interp, state) != TCL_OK) return TCL_ERROR;
     
-    llama_kv_self_clear(state->ctx);
+    llama_kv_self_seq_rm(state->ctx, 0, -1, -1);
     state->n_past = 0;
+    state->kv_tokens->clear();
     
     // Reset telemetría
     state->t_eval_ms = 0.0;
     state->t_gen_ms = 0.0;
     state->n_eval = 0;
     state->n_gen = 0;
+    state->n_reused = 0;
+    state->n_gen_allocs = 0;
+    state->n_drafted = 0;
+    state->n_accepted = 0;
+    state->n_spec_steps = 0;
+    state->draft_disabled = 0;
+    state->n_drafted_total = 0;
+    state->n_accepted_total = 0;
+    state->n_ctx_shifts = 0;
+    state->n_ctx_shifts_total = 0;
+    state->n_ctx_discarded_total = 0;
+    state->n_reused_total = 0;
+    state->n_eval_total = 0;
+    state->t_embed_ms = 0.0;
+    state->n_embed_texts = 0;
+    state->n_embed_tokens = 0;
+    state->t_embed_ms_total = 0.0;
+    state->n_embed_texts_total = 0;
     
     return TCL_OK;
 }
 
-static int Llama_Init_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
-    if (objc < 2 || objc > 3) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::init model_path ?n_ctx?", -1));
+/* ----------------- REGISTRO DE MODELOS ----------------- */
+// Los pesos se cargan una sola vez por proceso: la clave es la ruta normalizada
+// más los parámetros de carga. Cada contexto y cada handle de llama::model
+// guarda una referencia y el modelo se libera con la última. La carga ocurre
+// con el mutex tomado, así dos hilos que piden el mismo archivo no lo leen dos veces.
+
+typedef struct {
+    int n_gpu_layers;   // Capas en GPU (-1 = default de llama.cpp)
+    int use_mmap;       // Mapear el GGUF en vez de leerlo (-1 = default de llama.cpp)
+    int use_mlock;      // Fijar los pesos en RAM (sin paginación a swap)
+    int numa;           // Estrategia NUMA del proceso (-1 = no tocar)
+} ModelOptions;
+
+struct ModelEntry {
+    std::string          key;
+    std::string          path;    // Ruta normalizada
+    ModelOptions         opts;    // Parámetros con los que se cargó
+    struct llama_model  *model;
+    int                  refs;
+};
+
+#define MODEL_TAG 0x4c444f4dU
+
+// Handle de llama::model: una referencia propia sobre la entrada
+typedef struct {
+    unsigned int       tag;
+    struct ModelEntry *entry;
+} ModelHandle;
+
+TCL_DECLARE_MUTEX(model_registry_mutex)
+static std::map<std::string, ModelEntry*> *model_registry = NULL;
+
+static void model_options_defaults(ModelOptions *mo) {
+    mo->n_gpu_layers = -1;
+    mo->use_mmap = -1;
+    mo->use_mlock = 0;
+    mo->numa = -1;
+}
+
+static const char *const numa_names[] = { "disabled", "distribute", "isolate", "numactl", "mirror", NULL };
+
+// Aplica k si es un parámetro de carga; TCL_BREAK si es de otra cosa
+static int parse_model_option(Tcl_Interp *interp, const char *k, Tcl_Obj *value, ModelOptions *mo) {
+    if (strcmp(k, "n_gpu_layers") == 0) return Tcl_GetIntFromObj(interp, value, &mo->n_gpu_layers);
+    if (strcmp(k, "use_mmap") == 0) return Tcl_GetBooleanFromObj(interp, value, &mo->use_mmap);
+    if (strcmp(k, "use_mlock") == 0) return Tcl_GetBooleanFromObj(interp, value, &mo->use_mlock);
+    if (strcmp(k, "numa") == 0) {
+        return Tcl_GetIndexFromObj(interp, value, numa_names, "NUMA strategy", TCL_EXACT, &mo->numa);
+    }
+    return TCL_BREAK;
+}
+
+// La estrategia NUMA es global del proceso y llama.cpp sólo la aplica una vez,
+// antes de cargar pesos: pedir otra distinta después es error.
+static int numa_strategy = -1;
+
+static int numa_apply(Tcl_Interp *interp, int numa) {
+    if (numa < 0 || numa == numa_strategy) return TCL_OK;
+    if (numa_strategy >= 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("NUMA strategy already set to \"%s\" for this process", numa_names[numa_strategy]));
         return TCL_ERROR;
     }
+    llama_numa_init((enum ggml_numa_strategy)numa);
+    numa_strategy = numa;
+    return TCL_OK;
+}
+
+// Devuelve la entrada del modelo con una referencia nueva, cargándolo si hace falta
+static ModelEntry *model_acquire(Tcl_Interp *interp, Tcl_Obj *path_obj, const ModelOptions *mo) {
+    Tcl_Obj *norm = Tcl_FSGetNormalizedPath(interp, path_obj);
+    if (!norm) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid model path \"%s\"", Tcl_GetString(path_obj)));
+        return NULL;
+    }
+    std::string path = Tcl_GetString(norm);
     
-    const char *model_path = Tcl_GetString(objv[1]);
-    int n_ctx = 4096;
+    // La clave usa los valores efectivos: pedir explícitamente el valor por
+    // defecto (use_mmap 1, etc.) debe compartir los pesos ya cargados
+    llama_model_params mparams = llama_model_default_params();
+    if (mo->n_gpu_layers >= 0) mparams.n_gpu_layers = mo->n_gpu_layers;
+    if (mo->use_mmap >= 0) mparams.use_mmap = mo->use_mmap != 0;
+    mparams.use_mmap = mparams.use_mmap && llama_supports_mmap();
+    mparams.use_mlock = mo->use_mlock != 0 && llama_supports_mlock();
+    char params[64];
+    snprintf(params, sizeof(params), "\n%d\n%d\n%d", (int)mparams.n_gpu_layers,
+             (int)mparams.use_mmap, (int)mparams.use_mlock);
+    std::string key = path + params;
     
-    if (objc == 3) {
-        if (Tcl_GetIntFromObj(interp, objv[2], &n_ctx) != TCL_OK) {
-            return TCL_ERROR;
+    Tcl_DString native;
+    const char *native_path = Tcl_TranslateFileName(interp, path.c_str(), &native);
+    if (!native_path) return NULL;
+    
+    Tcl_MutexLock(&model_registry_mutex);
+    if (numa_apply(interp, mo->numa) != TCL_OK) {
+        Tcl_MutexUnlock(&model_registry_mutex);
+        Tcl_DStringFree(&native);
+        return NULL;
+    }
+    if (!model_registry) model_registry = new std::map<std::string, ModelEntry*>();
+    ModelEntry *entry = NULL;
+    auto it = model_registry->find(key);
+    if (it != model_registry->end()) {
+        entry = it->second;
+    } else {
+        struct llama_model *model = llama_model_load_from_file(native_path, mparams);
+        if (model) {
+            entry = new ModelEntry();
+            entry->key = key;
+            entry->path = path;
+            entry->opts = *mo;
+            entry->opts.n_gpu_layers = mparams.n_gpu_layers;
+            entry->opts.use_mmap = mparams.use_mmap;
+            entry->opts.use_mlock = mparams.use_mlock;
+            entry->model = model;
+            entry->refs = 0;
+            (*model_registry)[key] = entry;
         }
-        if (n_ctx < 512 || n_ctx > 32768) {
-            Tcl_SetObjResult(interp, Tcl_NewStringObj("n_ctx must be between 512 and 32768", -1));
-            return TCL_ERROR;
+    }
+    if (entry) entry->refs++;
+    Tcl_MutexUnlock(&model_registry_mutex);
+    Tcl_DStringFree(&native);
+    
+    if (!entry) Tcl_SetObjResult(interp, Tcl_NewStringObj("Failed to load model", -1));
+    return entry;
+}
+
+static void model_release(ModelEntry *entry) {
+    Tcl_MutexLock(&model_registry_mutex);
+    if (--entry->refs == 0) {
+        model_registry->erase(entry->key);
+        llama_model_free(entry->model);
+        delete entry;
+    }
+    Tcl_MutexUnlock(&model_registry_mutex);
+}
+
+static ModelHandle *model_from_obj(Tcl_Interp *interp, Tcl_Obj *obj) {
+    Tcl_CmdInfo info;
+    if (Tcl_GetCommandInfo(interp, Tcl_GetString(obj), &info) == 0 ||
+        !info.objClientData || ((ModelHandle*)info.objClientData)->tag != MODEL_TAG) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid model handle", -1));
+        return NULL;
+    }
+    return (ModelHandle*)info.objClientData;
+}
+
+/* ----------------- OPCIONES DE INIT ----------------- */
+typedef struct {
+    int n_ctx;
+    int n_seq_max;    // Secuencias del KV cache (1 = sólo generate/chat)
+    int ctx_shift;    // Desplazar el contexto en vez de cortar al llenarse
+    int n_keep;       // Tokens iniciales que el shift nunca descarta
+    int n_batch;      // Tokens por llama_decode (bloques de ingestión del prompt)
+    int n_ubatch;     // Micro-batch físico: dimensiona los buffers de cómputo
+    int embeddings;   // Habilita llama::embed (contexto con pooling NONE)
+    int n_threads;        // Hilos para generar (0 = default de llama.cpp)
+    int n_threads_batch;  // Hilos para ingerir prompts (-1 = igual que n_threads)
+    enum ggml_type type_k;  // Tipo de los tensores K/V del cache (f16, q8_0, q4_0, ...)
+    enum ggml_type type_v;  // V cuantizado exige flash_attn
+    int flash_attn;
+    int offload_kqv;        // KV y atención en la GPU cuando hay capas descargadas
+    int warmup;             // Decode descartable al crear el contexto
+    ModelOptions model;   // Sólo llama::init: llama::context usa el modelo ya cargado
+} InitOptions;
+
+static void init_options_defaults(InitOptions *opts) {
+    opts->n_ctx = 4096;
+    opts->n_seq_max = 1;
+    opts->ctx_shift = 0;
+    opts->n_keep = 0;
+    opts->n_batch = 2048;
+    opts->n_ubatch = 512;
+    opts->embeddings = 0;
+    opts->n_threads = 0;
+    opts->n_threads_batch = -1;
+    opts->type_k = GGML_TYPE_F16;
+    opts->type_v = GGML_TYPE_F16;
+    opts->flash_attn = 0;
+    opts->offload_kqv = 1;
+    opts->warmup = 0;
+    model_options_defaults(&opts->model);
+}
+
+// Tipos que llama.cpp admite para el KV cache
+static const struct { const char *name; enum ggml_type type; } kv_cache_types[] = {
+    { "f32",    GGML_TYPE_F32 },
+    { "f16",    GGML_TYPE_F16 },
+    { "bf16",   GGML_TYPE_BF16 },
+    { "q8_0",   GGML_TYPE_Q8_0 },
+    { "q4_0",   GGML_TYPE_Q4_0 },
+    { "q4_1",   GGML_TYPE_Q4_1 },
+    { "iq4_nl", GGML_TYPE_IQ4_NL },
+    { "q5_0",   GGML_TYPE_Q5_0 },
+    { "q5_1",   GGML_TYPE_Q5_1 },
+};
+
+static int parse_kv_type(Tcl_Interp *interp, Tcl_Obj *value, enum ggml_type *type) {
+    const char *name = Tcl_GetString(value);
+    for (size_t i = 0; i < sizeof(kv_cache_types) / sizeof(kv_cache_types[0]); i++) {
+        if (strcmp(name, kv_cache_types[i].name) == 0) {
+            *type = kv_cache_types[i].type;
+            return TCL_OK;
         }
     }
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown KV cache type \"%s\": must be f32, f16, bf16, q8_0, q4_0, q4_1, iq4_nl, q5_0 or q5_1", name));
+    return TCL_ERROR;
+}
+
+static int kv_type_is_float(enum ggml_type type) {
+    return type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || type == GGML_TYPE_BF16;
+}
+
+// Lee el diccionario de opciones de llama::init / llama::context create. Las
+// claves desconocidas son error; las de carga del modelo sólo si with_model.
+static int parse_init_options(Tcl_Interp *interp, Tcl_Obj *dict, InitOptions *opts, int with_model) {
+    Tcl_DictSearch search;
+    Tcl_Obj *key, *value;
+    int done;
     
-    LlamaState *state = (LlamaState*)ckalloc(sizeof(LlamaState));
-    if (!state) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Memory allocation failed", -1));
+    if (Tcl_DictObjFirst(interp, dict, &search, &key, &value, &done) != TCL_OK) {
         return TCL_ERROR;
     }
     
-    memset(state, 0, sizeof(LlamaState));
-    set_defaults(state);
-    state->n_ctx = n_ctx;
+    int rc = TCL_OK;
+    for (; !done && rc == TCL_OK; Tcl_DictObjNext(&search, &key, &value, &done)) {
+        const char *k = Tcl_GetString(key);
+        if (strcmp(k, "n_ctx") == 0) {
+            rc = Tcl_GetIntFromObj(interp, value, &opts->n_ctx);
+        } else if (strcmp(k, "n_seq_max") == 0) {
+            rc = Tcl_GetIntFromObj(interp, value, &opts->n_seq_max);
+        } else if (strcmp(k, "ctx_shift") == 0) {
+            rc = Tcl_GetBooleanFromObj(interp, value, &opts->ctx_shift);
+        } else if (strcmp(k, "n_keep") == 0) {
+            rc = Tcl_GetIntFromObj(interp, value, &opts->n_keep);
+        } else if (strcmp(k, "n_batch") == 0) {
+            rc = Tcl_GetIntFromObj(interp, value, &opts->n_batch);
+        } else if (strcmp(k, "n_ubatch") == 0) {
+            rc = Tcl_GetIntFromObj(interp, value, &opts->n_ubatch);
+        } else if (strcmp(k, "embeddings") == 0) {
+            rc = Tcl_GetBooleanFromObj(interp, value, &opts->embeddings);
+        } else if (strcmp(k, "n_threads") == 0) {
+            rc = Tcl_GetIntFromObj(interp, value, &opts->n_threads);
+        } else if (strcmp(k, "n_threads_batch") == 0) {
+            rc = Tcl_GetIntFromObj(interp, value, &opts->n_threads_batch);
+        } else if (strcmp(k, "type_k") == 0) {
+            rc = parse_kv_type(interp, value, &opts->type_k);
+        } else if (strcmp(k, "type_v") == 0) {
+            rc = parse_kv_type(interp, value, &opts->type_v);
+        } else if (strcmp(k, "flash_attn") == 0) {
+            rc = Tcl_GetBooleanFromObj(interp, value, &opts->flash_attn);
+        } else if (strcmp(k, "offload_kqv") == 0) {
+            rc = Tcl_GetBooleanFromObj(interp, value, &opts->offload_kqv);
+        } else if (strcmp(k, "warmup") == 0) {
+            rc = Tcl_GetBooleanFromObj(interp, value, &opts->warmup);
+        } else if ((rc = parse_model_option(interp, k, value, &opts->model)) == TCL_BREAK || !with_model) {
+            if (rc == TCL_BREAK) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown init option \"%s\"", k));
+            } else {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Option \"%s\" belongs to llama::model load", k));
+            }
+            rc = TCL_ERROR;
+        }
+    }
+    Tcl_DictObjDone(&search);
+    return rc;
+}
+
+// Decode descartable de BOS+EOS y luego un paso de un token: recorre todos los
+// pesos (con mmap trae sus páginas a memoria) y ejercita los grafos de ingestión
+// y de generación, así el primer pedido real tiene el TTFT del estado estable.
+static void context_warmup(LlamaState *state) {
+    auto t_start = std::chrono::high_resolution_clock::now();
+    llama_token tmp[2];
+    int n = 0;
+    llama_token bos = llama_vocab_bos(state->vocab);
+    llama_token eos = llama_vocab_eos(state->vocab);
+    if (bos >= 0) tmp[n++] = bos;
+    if (eos >= 0) tmp[n++] = eos;
+    if (n == 0) tmp[n++] = 0;
     
-    llama_model_params mparams = llama_model_default_params();
-    state->model = llama_model_load_from_file(model_path, mparams);
+    if (llama_decode(state->ctx, llama_batch_get_one(tmp, n)) == 0) {
+        llama_decode(state->ctx, llama_batch_get_one(tmp, 1));
+    }
+    llama_synchronize(state->ctx);
+    llama_kv_self_seq_rm(state->ctx, 0, -1, -1);
     
-    if (!state->model) {
-        ckfree((char*)state);
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Failed to load model", -1));
+    auto t_end = std::chrono::high_resolution_clock::now();
+    state->t_warmup_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+}
+
+// Crea un contexto sobre un modelo del registro y deja su handle como resultado.
+// Se queda con la referencia de entry si tiene éxito; si falla, el llamador la libera.
+static int context_create(Tcl_Interp *interp, ModelEntry *entry, InitOptions *opts) {
+    int n_ctx = opts->n_ctx;
+    if (n_ctx < 512 || n_ctx > 32768) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("n_ctx must be between 512 and 32768", -1));
+        return TCL_ERROR;
+    }
+    if (opts->n_seq_max < 1 || opts->n_seq_max > 64) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("n_seq_max must be between 1 and 64", -1));
         return TCL_ERROR;
     }
+    if (opts->n_keep < 0 || opts->n_keep >= n_ctx / 2) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("n_keep must be between 0 and n_ctx/2", -1));
+        return TCL_ERROR;
+    }
+    if (opts->n_batch < 32 || opts->n_ubatch < 32) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("n_batch and n_ubatch must be at least 32", -1));
+        return TCL_ERROR;
+    }
+    // llama::batch pone un token por secuencia en generación en cada paso
+    if (opts->n_seq_max - 1 > opts->n_batch) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("n_batch must be at least n_seq_max - 1", -1));
+        return TCL_ERROR;
+    }
+    if (opts->n_threads < 0 || opts->n_threads > THREADS_MAX ||
+        opts->n_threads_batch < -1 || opts->n_threads_batch > THREADS_MAX) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("n_threads and n_threads_batch must be between 1 and %d", THREADS_MAX));
+        return TCL_ERROR;
+    }
+    if (!kv_type_is_float(opts->type_v) && !opts->flash_attn) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("A quantized type_v requires flash_attn 1", -1));
+        return TCL_ERROR;
+    }
+    // Un bloque nunca supera el contexto, ni el micro-batch al bloque
+    if (opts->n_batch > n_ctx) opts->n_batch = n_ctx;
+    if (opts->n_ubatch > opts->n_batch) opts->n_ubatch = opts->n_batch;
     
     llama_context_params cparams = llama_context_default_params();
     cparams.n_ctx = n_ctx;
-    cparams.n_batch = 2048;
-    
-    state->ctx = llama_init_from_model(state->model, cparams);
+    cparams.n_batch = opts->n_batch;
+    cparams.n_ubatch = opts->n_ubatch;
+    cparams.n_seq_max = opts->n_seq_max;
+    if (opts->n_threads > 0) cparams.n_threads = opts->n_threads;
+    if (opts->n_threads_batch > 0) {
+        cparams.n_threads_batch = opts->n_threads_batch;
+    } else if (opts->n_threads_batch == -1 && opts->n_threads > 0) {
+        cparams.n_threads_batch = opts->n_threads;
+    }
+    cparams.type_k = opts->type_k;
+    cparams.type_v = opts->type_v;
+    cparams.flash_attn = opts->flash_attn != 0;
+    cparams.offload_kqv = opts->offload_kqv != 0;
+    // Embeddings por token; llama::embed los activa sólo durante su decode
+    if (opts->embeddings) cparams.pooling_type = LLAMA_POOLING_TYPE_NONE;
     
-    if (!state->ctx) {
-        llama_model_free(state->model);
-        ckfree((char*)state);
+    struct llama_context *ctx = llama_init_from_model(entry->model, cparams);
+    if (!ctx) {
         Tcl_SetObjResult(interp, Tcl_NewStringObj("Failed to create context", -1));
         return TCL_ERROR;
     }
     
+    LlamaState *state = (LlamaState*)ckalloc(sizeof(LlamaState));
+    memset(state, 0, sizeof(LlamaState));
+    state->tag = STATE_TAG;
+    set_defaults(state);
+    state->n_ctx = n_ctx;
+    state->ctx_shift = opts->ctx_shift;
+    state->n_keep = opts->n_keep;
+    state->embeddings = opts->embeddings;
+    state->model_entry = entry;
+    state->model = entry->model;
+    state->ctx = ctx;
+    state->type_k = opts->type_k;
+    state->type_v = opts->type_v;
+    state->flash_attn = opts->flash_attn;
+    state->offload_kqv = opts->offload_kqv;
+    
     state->vocab = llama_model_get_vocab(state->model);
+    state->pieces = piece_table_acquire(state->vocab);
+    state->kv_tokens = new std::vector<llama_token>();
+    state->kv_tokens->reserve(state->n_ctx);
+    state->tok_batch = llama_batch_init(1, 0, 1);
+    state->profiles = new std::map<std::string, SamplerProfile>();
+    state->stages = new std::map<std::string, StageEntry>();
     apply_options(interp, NULL, state);
+    if (opts->warmup) context_warmup(state);
     
     char handle[64];
     snprintf(handle, sizeof(handle), "llama%p", (void*)state);
@@ -944,29 +5247,191 @@ static int Llama_Init_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *
     return TCL_OK;
 }
 
+static int Llama_Init_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 2 || objc > 4) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::init model_path ?n_ctx? ?options?", -1));
+        return TCL_ERROR;
+    }
+    
+    InitOptions opts;
+    init_options_defaults(&opts);
+    
+    if (objc >= 3) {
+        if (Tcl_GetIntFromObj(interp, objv[2], &opts.n_ctx) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+    if (objc == 4 && parse_init_options(interp, objv[3], &opts, 1) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    
+    // Mismo archivo y parámetros de carga: se comparten los pesos ya cargados
+    ModelEntry *entry = model_acquire(interp, objv[1], &opts.model);
+    if (!entry) return TCL_ERROR;
+    if (context_create(interp, entry, &opts) != TCL_OK) {
+        model_release(entry);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/* ----------------- LLAMA::MODEL / LLAMA::CONTEXT ----------------- */
+// llama::model load devuelve un handle de modelo; llama::context create abre
+// contextos independientes sobre él. Los contextos se liberan con llama::free
+// y el modelo se descarga cuando ya no queda ni el handle ni ningún contexto.
+static int Llama_Model_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 2) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::model load|free|info|list ?args?", -1));
+        return TCL_ERROR;
+    }
+    const char *sub = Tcl_GetString(objv[1]);
+    
+    if (strcmp(sub, "load") == 0) {
+        if (objc < 3 || objc > 4) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::model load path ?options?", -1));
+            return TCL_ERROR;
+        }
+        ModelOptions mo;
+        model_options_defaults(&mo);
+        if (objc == 4) {
+            Tcl_DictSearch search;
+            Tcl_Obj *key, *value;
+            int done;
+            if (Tcl_DictObjFirst(interp, objv[3], &search, &key, &value, &done) != TCL_OK) return TCL_ERROR;
+            int rc = TCL_OK;
+            for (; !done && rc == TCL_OK; Tcl_DictObjNext(&search, &key, &value, &done)) {
+                rc = parse_model_option(interp, Tcl_GetString(key), value, &mo);
+                if (rc == TCL_BREAK) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown model option \"%s\"", Tcl_GetString(key)));
+                    rc = TCL_ERROR;
+                }
+            }
+            Tcl_DictObjDone(&search);
+            if (rc != TCL_OK) return TCL_ERROR;
+        }
+        
+        ModelEntry *entry = model_acquire(interp, objv[2], &mo);
+        if (!entry) return TCL_ERROR;
+        ModelHandle *mh = (ModelHandle*)ckalloc(sizeof(ModelHandle));
+        mh->tag = MODEL_TAG;
+        mh->entry = entry;
+        
+        char handle[64];
+        snprintf(handle, sizeof(handle), "llamamodel%p", (void*)mh);
+        Tcl_CreateObjCommand(interp, handle, NULL, mh, NULL);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(handle, -1));
+        return TCL_OK;
+    }
+    
+    if (strcmp(sub, "list") == 0) {
+        // Modelos cargados en todo el proceso, con sus referencias
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+        Tcl_MutexLock(&model_registry_mutex);
+        if (model_registry) {
+            for (auto &kv : *model_registry) {
+                Tcl_Obj *pair[2] = { Tcl_NewStringObj(kv.second->path.c_str(), -1), Tcl_NewIntObj(kv.second->refs) };
+                Tcl_ListObjAppendElement(interp, list, Tcl_NewListObj(2, pair));
+            }
+        }
+        Tcl_MutexUnlock(&model_registry_mutex);
+        Tcl_SetObjResult(interp, list);
+        return TCL_OK;
+    }
+    
+    if (strcmp(sub, "free") != 0 && strcmp(sub, "info") != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::model load|free|info|list ?args?", -1));
+        return TCL_ERROR;
+    }
+    if (objc != 3) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Usage: llama::model %s model", sub));
+        return TCL_ERROR;
+    }
+    ModelHandle *mh = model_from_obj(interp, objv[2]);
+    if (!mh) return TCL_ERROR;
+    ModelEntry *entry = mh->entry;
+    
+    if (sub[0] == 'f') {
+        // Los contextos abiertos conservan su propia referencia
+        Tcl_DeleteCommand(interp, Tcl_GetString(objv[2]));
+        model_release(entry);
+        ckfree((char*)mh);
+        return TCL_OK;
+    }
+    
+    char desc[256];
+    llama_model_desc(entry->model, desc, sizeof(desc));
+    Tcl_MutexLock(&model_registry_mutex);
+    int refs = entry->refs;
+    Tcl_MutexUnlock(&model_registry_mutex);
+    
+    Tcl_Obj *dict = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("path", -1), Tcl_NewStringObj(entry->path.c_str(), -1));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("refs", -1), Tcl_NewIntObj(refs));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("use_mmap", -1), Tcl_NewIntObj(entry->opts.use_mmap));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("use_mlock", -1), Tcl_NewIntObj(entry->opts.use_mlock));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("numa", -1),
+                   Tcl_NewStringObj(numa_strategy >= 0 ? numa_names[numa_strategy] : "disabled", -1));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("model_desc", -1), Tcl_NewStringObj(desc, -1));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("model_size", -1),
+                   Tcl_NewWideIntObj(llama_model_size(entry->model)));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("model_n_params", -1),
+                   Tcl_NewWideIntObj(llama_model_n_params(entry->model)));
+    Tcl_SetObjResult(interp, dict);
+    return TCL_OK;
+}
+
+static int Llama_Context_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 3 || objc > 4 || strcmp(Tcl_GetString(objv[1]), "create") != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::context create model ?options?", -1));
+        return TCL_ERROR;
+    }
+    ModelHandle *mh = model_from_obj(interp, objv[2]);
+    if (!mh) return TCL_ERROR;
+    
+    InitOptions opts;
+    init_options_defaults(&opts);
+    if (objc == 4 && parse_init_options(interp, objv[3], &opts, 0) != TCL_OK) return TCL_ERROR;
+    
+    ModelEntry *entry = mh->entry;
+    Tcl_MutexLock(&model_registry_mutex);
+    entry->refs++;
+    Tcl_MutexUnlock(&model_registry_mutex);
+    if (context_create(interp, entry, &opts) != TCL_OK) {
+        model_release(entry);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
 static int Llama_Free_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     if (objc != 2) {
         Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::free handle", -1));
         return TCL_ERROR;
     }
     
-    Tcl_CmdInfo info;
-    if (Tcl_GetCommandInfo(interp, Tcl_GetString(objv[1]), &info) == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid handle", -1));
-        return TCL_ERROR;
-    }
-    LlamaState *state = (LlamaState*)info.objClientData;
+    LlamaState *state = state_from_obj(interp, objv[1]);
+    if (!state) return TCL_ERROR;
+    if (check_idle(interp, state) != TCL_OK) return TCL_ERROR;
     
+    piece_table_release(state->pieces);
     if (state->ctx) llama_free(state->ctx);
-    if (state->model) llama_model_free(state->model);
-    if (state->sampler) llama_sampler_free(state->sampler);
+    if (state->model_entry) model_release(state->model_entry);
+    if (state->engine) batch_engine_free(state->engine);
+    sampler_cache_free(state);
+    stage_cache_free(state);
+    delete state->profiles;
+    delete state->kv_tokens;
+    llama_batch_free(state->tok_batch);
     
+    state->tag = 0;
     ckfree((char*)state);
     Tcl_DeleteCommand(interp, Tcl_GetString(objv[1]));
     
     return TCL_OK;
 }
 
+int Tclllama_IndexInit(Tcl_Interp *interp);
+
 int Tclllama_Init(Tcl_Interp *interp) {
     if (Tcl_InitStubs(interp, "8.6", 0) == NULL) {
         return TCL_ERROR;
@@ -975,6 +5440,8 @@ int Tclllama_Init(Tcl_Interp *interp) {
     Tcl_CreateObjCommand(interp, "llama::version", Llama_Version_Cmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "llama::init", Llama_Init_Cmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "llama::free", Llama_Free_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::model", Llama_Model_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::context", Llama_Context_Cmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "llama::generate", Llama_Generate_Cmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "llama::chat", Llama_Chat, NULL, NULL);
     Tcl_CreateObjCommand(interp, "llama::tokenize", Llama_Tokenize_Cmd, NULL, NULL);
@@ -983,6 +5450,18 @@ int Tclllama_Init(Tcl_Interp *interp) {
     Tcl_CreateObjCommand(interp, "llama::get_context", Llama_GetContext_Cmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "llama::info", Llama_Info_Cmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "llama::verbose", Llama_Verbose_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::threads", Llama_Threads_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::bench", Llama_Bench_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::stats", Llama_Stats_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::trace", Llama_Trace_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::batch", Llama_Batch_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::request", Llama_Request_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::profile", Llama_Profile_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::session", Llama_Session_Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "llama::embed", Llama_Embed_Cmd, NULL, NULL);
+    
+    // Índice vectorial (tclllama_index.c)
+    if (Tclllama_IndexInit(interp) != TCL_OK) return TCL_ERROR;
     
     return Tcl_PkgProvide(interp, "tclllama", "7.5");
 }
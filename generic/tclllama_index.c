@@ -0,0 +1,1061 @@
+/*
+ * tclllama_index.c - Índice vectorial HNSW en proceso (llama::index)
+ * Búsqueda de vecinos aproximada para los embeddings de llama::embed, con
+ * archivo mapeable en memoria y kernels de distancia AVX2/NEON/escalares.
+ */
+
+#include <tcl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if !defined(TCLLLAMA_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define INDEX_X86 1
+#include <immintrin.h>
+#elif !defined(TCLLLAMA_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define INDEX_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ----------------- KERNELS DE DISTANCIA ----------------- */
+// Escalares: referencia y resto de los kernels vectoriales
+static float dot_scalar(const float *a, const float *b, int n) {
+    float s = 0.0f;
+    for (int i = 0; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+static float l2_scalar(const float *a, const float *b, int n) {
+    float s = 0.0f;
+    for (int i = 0; i < n; i++) {
+        float d = a[i] - b[i];
+        s += d * d;
+    }
+    return s;
+}
+
+#ifdef INDEX_X86
+// Compilados para AVX2+FMA aunque el resto del módulo no lo esté; sólo se
+// usan si la CPU los soporta (ver index_select_kernels)
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    return _mm_cvtss_f32(lo);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    float s = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+__attribute__((target("avx2,fma")))
+static float l2_avx2(const float *a, const float *b, int n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+    float s = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        float d = a[i] - b[i];
+        s += d * d;
+    }
+    return s;
+}
+#endif
+
+#ifdef INDEX_NEON
+// NEON es obligatorio en aarch64: sin detección en tiempo de ejecución
+static float dot_neon(const float *a, const float *b, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float s = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+static float l2_neon(const float *a, const float *b, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc0 = vfmaq_f32(acc0, d0, d0);
+        acc1 = vfmaq_f32(acc1, d1, d1);
+    }
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t d = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        acc0 = vfmaq_f32(acc0, d, d);
+    }
+    float s = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < n; i++) {
+        float d = a[i] - b[i];
+        s += d * d;
+    }
+    return s;
+}
+#endif
+
+static float (*k_dot)(const float*, const float*, int) = dot_scalar;
+static float (*k_l2)(const float*, const float*, int)  = l2_scalar;
+static const char *k_name = "scalar";
+
+static void index_select_kernels(void) {
+#if defined(INDEX_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        k_dot = dot_avx2;
+        k_l2 = l2_avx2;
+        k_name = "avx2";
+    }
+#elif defined(INDEX_NEON)
+    k_dot = dot_neon;
+    k_l2 = l2_neon;
+    k_name = "neon";
+#endif
+}
+
+/* ----------------- ESTRUCTURA DEL ÍNDICE ----------------- */
+// Grafo HNSW en arreglos planos, con el mismo layout en memoria y en disco:
+//   ids[count]                    id del usuario (int64)
+//   vecs[count * dim]             vectores (normalizados si la métrica es cosine)
+//   levels[count]                 nivel máximo de cada nodo
+//   links0[count * (M0 + 1)]      nivel 0: [n, vecino...]
+//   upper_off[count]              inicio del nodo en upper (niveles >= 1)
+//   upper[...]                    por nivel 1..L: [n, vecino...] de M + 1
+// Tras llama::index load los punteros p_* apuntan al archivo mapeado; el
+// primer add copia a los vectores propios y libera el mapeo.
+
+#define INDEX_MAGIC     "TCLLIDX1"
+#define INDEX_VERSION   1
+#define INDEX_ALIGN     64
+#define INDEX_TAG       0x58444c4cU
+#define INDEX_MAX_LEVEL 16
+#define INDEX_DIM_MAX   65536
+#define INDEX_M_MAX     128
+
+enum { METRIC_L2 = 0, METRIC_IP, METRIC_COSINE };
+static const char *metric_names[] = { "l2", "ip", "cosine" };
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int32_t  dim;
+    int32_t  metric;
+    int32_t  M;
+    int32_t  M0;
+    int32_t  ef_construction;
+    int32_t  ef_search;
+    int32_t  max_level;
+    int32_t  entry;
+    uint64_t count;
+    uint64_t rng;
+    uint64_t off_ids;
+    uint64_t off_vecs;
+    uint64_t off_levels;
+    uint64_t off_links0;
+    uint64_t off_upper_off;
+    uint64_t off_upper;
+    uint64_t n_upper;
+    uint64_t reserved;
+} IndexHeader;
+
+typedef std::pair<float, int32_t> Cand;
+
+struct VectorIndex {
+    uint32_t tag;
+    int      dim;
+    int      metric;
+    int      M;
+    int      M0;
+    int      ef_construction;
+    int      ef_search;
+    int      max_level;
+    int32_t  entry;
+    uint64_t rng;
+    double   level_mult;
+    size_t   count;
+
+    // Datos propios (vacíos mientras el índice está mapeado)
+    std::vector<int64_t>  ids;
+    std::vector<float>    vecs;
+    std::vector<int32_t>  levels;
+    std::vector<int32_t>  links0;
+    std::vector<uint32_t> upper_off;
+    std::vector<int32_t>  upper;
+
+    // Vistas de lectura: a los vectores propios o al archivo mapeado
+    const int64_t  *p_ids;
+    const float    *p_vecs;
+    const int32_t  *p_levels;
+    const int32_t  *p_links0;
+    const uint32_t *p_upper_off;
+    const int32_t  *p_upper;
+    size_t          n_upper;
+
+    void   *map;          // Archivo completo (mmap; copia en memoria en Windows)
+    size_t  map_size;
+
+    std::unordered_map<int64_t, int32_t> by_id;   // Sólo con datos propios
+
+    // Búsqueda: marcas de visitado por época (sin limpiar entre consultas)
+    std::vector<uint32_t> visited;
+    uint32_t              epoch;
+    std::vector<float>    qbuf;
+
+    // Telemetría
+    Tcl_WideInt n_queries;
+    Tcl_WideInt n_dist;       // Distancias calculadas en la última consulta
+    double      t_query_us;
+    double      t_query_us_total;
+};
+
+static inline const float *index_vec(const VectorIndex *idx, int32_t node) {
+    return idx->p_vecs + (size_t)node * idx->dim;
+}
+
+static inline const int32_t *index_links(const VectorIndex *idx, int32_t node, int lc) {
+    if (lc == 0) return idx->p_links0 + (size_t)node * (idx->M0 + 1);
+    return idx->p_upper + idx->p_upper_off[node] + (size_t)(lc - 1) * (idx->M + 1);
+}
+
+// Sólo válido con datos propios (index_own)
+static inline int32_t *index_links_mut(VectorIndex *idx, int32_t node, int lc) {
+    return (int32_t*)index_links(idx, node, lc);
+}
+
+static inline float index_dist(VectorIndex *idx, const float *a, const float *b) {
+    idx->n_dist++;
+    switch (idx->metric) {
+        case METRIC_L2: return k_l2(a, b, idx->dim);
+        case METRIC_IP: return -k_dot(a, b, idx->dim);
+        default:        return 1.0f - k_dot(a, b, idx->dim);
+    }
+}
+
+static void index_sync_views(VectorIndex *idx) {
+    idx->p_ids = idx->ids.data();
+    idx->p_vecs = idx->vecs.data();
+    idx->p_levels = idx->levels.data();
+    idx->p_links0 = idx->links0.data();
+    idx->p_upper_off = idx->upper_off.data();
+    idx->p_upper = idx->upper.data();
+    idx->n_upper = idx->upper.size();
+}
+
+static void index_unmap(VectorIndex *idx) {
+    if (!idx->map) return;
+#ifdef _WIN32
+    ckfree((char*)idx->map);
+#else
+    munmap(idx->map, idx->map_size);
+#endif
+    idx->map = NULL;
+    idx->map_size = 0;
+}
+
+// Copia los datos mapeados a memoria propia antes de modificar el grafo
+static void index_own(VectorIndex *idx) {
+    if (!idx->map) return;
+    size_t n = idx->count;
+    idx->ids.assign(idx->p_ids, idx->p_ids + n);
+    idx->vecs.assign(idx->p_vecs, idx->p_vecs + n * idx->dim);
+    idx->levels.assign(idx->p_levels, idx->p_levels + n);
+    idx->links0.assign(idx->p_links0, idx->p_links0 + n * (idx->M0 + 1));
+    idx->upper_off.assign(idx->p_upper_off, idx->p_upper_off + n);
+    idx->upper.assign(idx->p_upper, idx->p_upper + idx->n_upper);
+    index_unmap(idx);
+    index_sync_views(idx);
+
+    idx->by_id.reserve(n);
+    for (size_t i = 0; i < n; i++) idx->by_id[idx->ids[i]] = (int32_t)i;
+}
+
+static VectorIndex *index_new(int dim, int metric, int M, int ef_construction, int ef_search) {
+    VectorIndex *idx = new VectorIndex();
+    idx->tag = INDEX_TAG;
+    idx->dim = dim;
+    idx->metric = metric;
+    idx->M = M;
+    idx->M0 = 2 * M;
+    idx->ef_construction = ef_construction;
+    idx->ef_search = ef_search;
+    idx->max_level = -1;
+    idx->entry = -1;
+    idx->rng = 0x9E3779B97F4A7C15ULL;
+    idx->level_mult = 1.0 / log((double)M);
+    index_sync_views(idx);
+    return idx;
+}
+
+static void index_free(VectorIndex *idx) {
+    index_unmap(idx);
+    idx->tag = 0;
+    delete idx;
+}
+
+/* ----------------- HNSW ----------------- */
+static int index_random_level(VectorIndex *idx) {
+    // xorshift64*: determinista, así el mismo orden de inserción da el mismo grafo
+    idx->rng ^= idx->rng >> 12;
+    idx->rng ^= idx->rng << 25;
+    idx->rng ^= idx->rng >> 27;
+    uint64_t r = idx->rng * 2685821657736338717ULL;
+    double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+    int level = (int)(-log(u) * idx->level_mult);
+    return level < INDEX_MAX_LEVEL ? level : INDEX_MAX_LEVEL;
+}
+
+static uint32_t index_next_epoch(VectorIndex *idx) {
+    if (idx->visited.size() < idx->count) idx->visited.resize(idx->count, 0);
+    if (++idx->epoch == 0) {
+        std::fill(idx->visited.begin(), idx->visited.end(), 0);
+        idx->epoch = 1;
+    }
+    return idx->epoch;
+}
+
+// Descenso voraz en un nivel superior (ef = 1)
+static Cand index_greedy(VectorIndex *idx, const float *q, Cand cur, int lc) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        const int32_t *l = index_links(idx, cur.second, lc);
+        for (int j = 1; j <= l[0]; j++) {
+            float d = index_dist(idx, q, index_vec(idx, l[j]));
+            if (d < cur.first) {
+                cur = Cand(d, l[j]);
+                changed = true;
+            }
+        }
+    }
+    return cur;
+}
+
+// Búsqueda con lista dinámica de ef candidatos; out queda ordenado ascendente
+static void index_search_layer(VectorIndex *idx, const float *q, const std::vector<Cand> &eps,
+                               int ef, int lc, std::vector<Cand> &out) {
+    uint32_t epoch = index_next_epoch(idx);
+    std::priority_queue<Cand, std::vector<Cand>, std::greater<Cand> > cand;
+    std::priority_queue<Cand> top;
+
+    for (size_t i = 0; i < eps.size(); i++) {
+        if (idx->visited[eps[i].second] == epoch) continue;
+        idx->visited[eps[i].second] = epoch;
+        cand.push(eps[i]);
+        top.push(eps[i]);
+        if ((int)top.size() > ef) top.pop();
+    }
+
+    while (!cand.empty()) {
+        Cand c = cand.top();
+        if ((int)top.size() >= ef && c.first > top.top().first) break;
+        cand.pop();
+
+        const int32_t *l = index_links(idx, c.second, lc);
+        for (int j = 1; j <= l[0]; j++) {
+            int32_t e = l[j];
+            if (idx->visited[e] == epoch) continue;
+            idx->visited[e] = epoch;
+            float d = index_dist(idx, q, index_vec(idx, e));
+            if ((int)top.size() < ef || d < top.top().first) {
+                cand.push(Cand(d, e));
+                top.push(Cand(d, e));
+                if ((int)top.size() > ef) top.pop();
+            }
+        }
+    }
+
+    out.resize(top.size());
+    for (size_t i = out.size(); i-- > 0; ) {
+        out[i] = top.top();
+        top.pop();
+    }
+}
+
+// Heurística de HNSW: un candidato entra si está más cerca de la base que de
+// todos los ya elegidos (mantiene vecinos en direcciones distintas)
+static void index_select(VectorIndex *idx, const std::vector<Cand> &sorted, int m,
+                         std::vector<Cand> &out) {
+    out.clear();
+    for (size_t i = 0; i < sorted.size() && (int)out.size() < m; i++) {
+        const float *v = index_vec(idx, sorted[i].second);
+        bool good = true;
+        for (size_t r = 0; r < out.size(); r++) {
+            if (index_dist(idx, v, index_vec(idx, out[r].second)) < sorted[i].first) {
+                good = false;
+                break;
+            }
+        }
+        if (good) out.push_back(sorted[i]);
+    }
+}
+
+static void index_connect(VectorIndex *idx, int32_t from, int32_t to, int lc) {
+    int m_max = lc == 0 ? idx->M0 : idx->M;
+    int32_t *l = index_links_mut(idx, from, lc);
+    if (l[0] < m_max) {
+        l[++l[0]] = to;
+        return;
+    }
+
+    // Lista llena: volver a elegir entre los actuales y el nuevo
+    const float *base = index_vec(idx, from);
+    std::vector<Cand> cands, keep;
+    cands.reserve(m_max + 1);
+    for (int j = 1; j <= l[0]; j++) {
+        cands.push_back(Cand(index_dist(idx, base, index_vec(idx, l[j])), l[j]));
+    }
+    cands.push_back(Cand(index_dist(idx, base, index_vec(idx, to)), to));
+    std::sort(cands.begin(), cands.end());
+    index_select(idx, cands, m_max, keep);
+
+    l[0] = (int32_t)keep.size();
+    for (size_t j = 0; j < keep.size(); j++) l[j + 1] = keep[j].second;
+}
+
+static void index_insert(VectorIndex *idx, int64_t id, const float *v) {
+    int32_t node = (int32_t)idx->count;
+    int level = index_random_level(idx);
+
+    idx->ids.push_back(id);
+    idx->vecs.insert(idx->vecs.end(), v, v + idx->dim);
+    if (idx->metric == METRIC_COSINE) {
+        float *dst = &idx->vecs[(size_t)node * idx->dim];
+        float norm = sqrtf(dot_scalar(dst, dst, idx->dim));
+        if (norm > 0.0f) {
+            for (int d = 0; d < idx->dim; d++) dst[d] /= norm;
+        }
+    }
+    idx->levels.push_back(level);
+    idx->links0.resize(idx->links0.size() + idx->M0 + 1, 0);
+    idx->upper_off.push_back(level > 0 ? (uint32_t)idx->upper.size() : 0);
+    if (level > 0) idx->upper.resize(idx->upper.size() + (size_t)level * (idx->M + 1), 0);
+    idx->count++;
+    idx->by_id[id] = node;
+    index_sync_views(idx);
+
+    if (idx->entry < 0) {
+        idx->entry = node;
+        idx->max_level = level;
+        return;
+    }
+
+    const float *q = index_vec(idx, node);
+    Cand ep(index_dist(idx, q, index_vec(idx, idx->entry)), idx->entry);
+    for (int lc = idx->max_level; lc > level; lc--) {
+        ep = index_greedy(idx, q, ep, lc);
+    }
+
+    std::vector<Cand> eps(1, ep), found, chosen;
+    for (int lc = std::min(level, idx->max_level); lc >= 0; lc--) {
+        index_search_layer(idx, q, eps, idx->ef_construction, lc, found);
+        index_select(idx, found, idx->M, chosen);
+
+        int32_t *l = index_links_mut(idx, node, lc);
+        l[0] = (int32_t)chosen.size();
+        for (size_t j = 0; j < chosen.size(); j++) l[j + 1] = chosen[j].second;
+        for (size_t j = 0; j < chosen.size(); j++) index_connect(idx, chosen[j].second, node, lc);
+        eps.swap(found);
+    }
+
+    if (level > idx->max_level) {
+        idx->max_level = level;
+        idx->entry = node;
+    }
+}
+
+static void index_query(VectorIndex *idx, const float *q, int k, int ef, std::vector<Cand> &out) {
+    out.clear();
+    if (idx->count == 0) return;
+
+    Cand ep(index_dist(idx, q, index_vec(idx, idx->entry)), idx->entry);
+    for (int lc = idx->max_level; lc > 0; lc--) {
+        ep = index_greedy(idx, q, ep, lc);
+    }
+    std::vector<Cand> eps(1, ep);
+    index_search_layer(idx, q, eps, std::max(ef, k), 0, out);
+    if ((int)out.size() > k) out.resize(k);
+}
+
+/* ----------------- ARCHIVO ----------------- */
+static uint64_t index_align(uint64_t off) {
+    return (off + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+}
+
+// Offsets de las secciones: dependen sólo del tamaño, así load los verifica
+static void index_layout(IndexHeader *hdr, uint64_t n, int dim, int M0) {
+    hdr->off_ids       = index_align(sizeof(IndexHeader));
+    hdr->off_vecs      = index_align(hdr->off_ids + n * sizeof(int64_t));
+    hdr->off_levels    = index_align(hdr->off_vecs + n * dim * sizeof(float));
+    hdr->off_links0    = index_align(hdr->off_levels + n * sizeof(int32_t));
+    hdr->off_upper_off = index_align(hdr->off_links0 + n * (M0 + 1) * sizeof(int32_t));
+    hdr->off_upper     = index_align(hdr->off_upper_off + n * sizeof(uint32_t));
+}
+
+static void index_fill_header(const VectorIndex *idx, IndexHeader *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, INDEX_MAGIC, 8);
+    hdr->version = INDEX_VERSION;
+    hdr->header_size = sizeof(IndexHeader);
+    hdr->dim = idx->dim;
+    hdr->metric = idx->metric;
+    hdr->M = idx->M;
+    hdr->M0 = idx->M0;
+    hdr->ef_construction = idx->ef_construction;
+    hdr->ef_search = idx->ef_search;
+    hdr->max_level = idx->max_level;
+    hdr->entry = idx->entry;
+    hdr->count = idx->count;
+    hdr->rng = idx->rng;
+    hdr->n_upper = idx->n_upper;
+    index_layout(hdr, idx->count, idx->dim, idx->M0);
+}
+
+static bool index_write_section(FILE *f, uint64_t *pos, uint64_t off, const void *data, size_t len) {
+    static const char zeros[INDEX_ALIGN] = {0};
+    size_t pad = (size_t)(off - *pos);
+    if (pad > 0 && fwrite(zeros, 1, pad, f) != pad) return false;
+    if (len > 0 && fwrite(data, 1, len, f) != len) return false;
+    *pos = off + len;
+    return true;
+}
+
+static int index_save(Tcl_Interp *interp, VectorIndex *idx, const char *path) {
+    IndexHeader hdr;
+    index_fill_header(idx, &hdr);
+    size_t n = idx->count;
+
+    // Escribir a un temporal y renombrar, como llama::session save
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Cannot open \"%s\" for writing", tmp.c_str()));
+        return TCL_ERROR;
+    }
+
+    uint64_t pos = 0;
+    bool ok = index_write_section(f, &pos, 0, &hdr, sizeof(hdr)) &&
+              index_write_section(f, &pos, hdr.off_ids, idx->p_ids, n * sizeof(int64_t)) &&
+              index_write_section(f, &pos, hdr.off_vecs, idx->p_vecs, n * idx->dim * sizeof(float)) &&
+              index_write_section(f, &pos, hdr.off_levels, idx->p_levels, n * sizeof(int32_t)) &&
+              index_write_section(f, &pos, hdr.off_links0, idx->p_links0, n * (idx->M0 + 1) * sizeof(int32_t)) &&
+              index_write_section(f, &pos, hdr.off_upper_off, idx->p_upper_off, n * sizeof(uint32_t)) &&
+              index_write_section(f, &pos, hdr.off_upper, idx->p_upper, idx->n_upper * sizeof(int32_t));
+    if (fclose(f) != 0) ok = false;
+
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        remove(tmp.c_str());
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Failed to write index file \"%s\"", path));
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)pos));
+    return TCL_OK;
+}
+
+// Comprueba que el grafo del archivo no apunte fuera de sus arreglos
+static const char *index_validate(const VectorIndex *idx) {
+    size_t n = idx->count;
+    if (n == 0) return (idx->entry == -1) ? NULL : "Index file is corrupt";
+    if (idx->entry < 0 || (size_t)idx->entry >= n ||
+        idx->max_level < 0 || idx->max_level > INDEX_MAX_LEVEL) {
+        return "Index file is corrupt";
+    }
+    // query/insert bajan desde max_level empezando en la entrada
+    if (idx->p_levels[idx->entry] != idx->max_level) return "Index file is corrupt";
+    for (size_t i = 0; i < n; i++) {
+        int level = idx->p_levels[i];
+        if (level < 0 || level > idx->max_level) return "Index file is corrupt";
+        if (level > 0 && (uint64_t)idx->p_upper_off[i] + (uint64_t)level * (idx->M + 1) > idx->n_upper) {
+            return "Index file is corrupt";
+        }
+        for (int lc = 0; lc <= level; lc++) {
+            const int32_t *l = index_links(idx, (int32_t)i, lc);
+            if (l[0] < 0 || l[0] > (lc == 0 ? idx->M0 : idx->M)) return "Index file is corrupt";
+            for (int j = 1; j <= l[0]; j++) {
+                if (l[j] < 0 || (size_t)l[j] >= n || idx->p_levels[l[j]] < lc) return "Index file is corrupt";
+            }
+        }
+    }
+    return NULL;
+}
+
+static int index_load(Tcl_Interp *interp, const char *path, VectorIndex **out) {
+    void *map = NULL;
+    size_t size = 0;
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        fseek(f, 0, SEEK_END);
+        long len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        if (len > 0) {
+            map = ckalloc((unsigned)len);
+            if (fread(map, 1, (size_t)len, f) != (size_t)len) {
+                ckfree((char*)map);
+                map = NULL;
+            }
+            size = (size_t)len;
+        }
+        fclose(f);
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                map = p;
+                size = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+    }
+#endif
+    if (!map) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Cannot open index file \"%s\"", path));
+        return TCL_ERROR;
+    }
+
+    IndexHeader hdr;
+    const char *bad = NULL;
+    if (size < sizeof(hdr)) {
+        bad = "Not an index file";
+    } else {
+        memcpy(&hdr, map, sizeof(hdr));
+        if (memcmp(hdr.magic, INDEX_MAGIC, 8) != 0 || hdr.header_size != sizeof(hdr)) {
+            bad = "Not an index file";
+        } else if (hdr.version != INDEX_VERSION) {
+            bad = "Unsupported index file version";
+        } else if (hdr.dim < 1 || hdr.dim > INDEX_DIM_MAX ||
+                   hdr.metric < METRIC_L2 || hdr.metric > METRIC_COSINE ||
+                   hdr.M < 2 || hdr.M > INDEX_M_MAX || hdr.M0 != 2 * hdr.M ||
+                   hdr.ef_construction < 1 || hdr.ef_search < 1 ||
+                   hdr.count > INT32_MAX || hdr.n_upper > size / sizeof(int32_t)) {
+            // Mismos límites que create: con ellos el cálculo de offsets no desborda
+            bad = "Index file is corrupt";
+        } else {
+            IndexHeader expect;
+            index_layout(&expect, hdr.count, hdr.dim, hdr.M0);
+            if (hdr.off_ids != expect.off_ids || hdr.off_vecs != expect.off_vecs ||
+                hdr.off_levels != expect.off_levels || hdr.off_links0 != expect.off_links0 ||
+                hdr.off_upper_off != expect.off_upper_off || hdr.off_upper != expect.off_upper ||
+                hdr.off_upper + hdr.n_upper * sizeof(int32_t) > size) {
+                bad = "Index file is truncated or corrupt";
+            }
+        }
+    }
+    if (bad) {
+#ifdef _WIN32
+        ckfree((char*)map);
+#else
+        munmap(map, size);
+#endif
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(bad, -1));
+        return TCL_ERROR;
+    }
+
+    VectorIndex *idx = index_new(hdr.dim, hdr.metric, hdr.M, hdr.ef_construction, hdr.ef_search);
+    const uint8_t *base = (const uint8_t*)map;
+    idx->map = map;
+    idx->map_size = size;
+    idx->count = (size_t)hdr.count;
+    idx->max_level = hdr.max_level;
+    idx->entry = hdr.entry;
+    idx->rng = hdr.rng;
+    idx->p_ids = (const int64_t*)(base + hdr.off_ids);
+    idx->p_vecs = (const float*)(base + hdr.off_vecs);
+    idx->p_levels = (const int32_t*)(base + hdr.off_levels);
+    idx->p_links0 = (const int32_t*)(base + hdr.off_links0);
+    idx->p_upper_off = (const uint32_t*)(base + hdr.off_upper_off);
+    idx->p_upper = (const int32_t*)(base + hdr.off_upper);
+    idx->n_upper = (size_t)hdr.n_upper;
+
+    bad = index_validate(idx);
+    if (bad) {
+        index_free(idx);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(bad, -1));
+        return TCL_ERROR;
+    }
+
+    *out = idx;
+    return TCL_OK;
+}
+
+/* ----------------- LLAMA::INDEX ----------------- */
+static VectorIndex *index_from_obj(Tcl_Interp *interp, Tcl_Obj *obj) {
+    Tcl_CmdInfo info;
+    if (Tcl_GetCommandInfo(interp, Tcl_GetString(obj), &info) == 0 ||
+        !info.objClientData || ((VectorIndex*)info.objClientData)->tag != INDEX_TAG) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid index handle", -1));
+        return NULL;
+    }
+    return (VectorIndex*)info.objClientData;
+}
+
+static void index_register(Tcl_Interp *interp, VectorIndex *idx) {
+    char handle[64];
+    snprintf(handle, sizeof(handle), "llamaidx%p", (void*)idx);
+    Tcl_CreateObjCommand(interp, handle, NULL, idx, NULL);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(handle, -1));
+}
+
+// Vectores como bytearray float32 (p. ej. llama::embed -format float32),
+// lista plana de n*dim números o lista de n vectores
+static int index_get_vectors(Tcl_Interp *interp, VectorIndex *idx, Tcl_Obj *obj, int n,
+                             std::vector<float> &out) {
+    size_t want = (size_t)n * idx->dim;
+    static const Tcl_ObjType *bytearray_type = Tcl_GetObjType("bytearray");
+
+    int n_elems = 0;
+    Tcl_Obj **elems = NULL;
+    bool is_list = obj->typePtr != bytearray_type &&
+                   Tcl_ListObjGetElements(NULL, obj, &n_elems, &elems) == TCL_OK &&
+                   ((size_t)n_elems == want || n_elems == n);
+
+    if (!is_list) {
+        int len;
+        const unsigned char *bytes = Tcl_GetByteArrayFromObj(obj, &len);
+        if ((size_t)len != want * sizeof(float)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Expected %d vector(s) of dimension %d", n, idx->dim));
+            return TCL_ERROR;
+        }
+        out.resize(want);
+        memcpy(out.data(), bytes, len);
+        return TCL_OK;
+    }
+
+    out.resize(want);
+    if ((size_t)n_elems == want) {
+        for (int i = 0; i < n_elems; i++) {
+            double d;
+            if (Tcl_GetDoubleFromObj(interp, elems[i], &d) != TCL_OK) return TCL_ERROR;
+            out[i] = (float)d;
+        }
+        return TCL_OK;
+    }
+    for (int i = 0; i < n; i++) {
+        int n_row;
+        Tcl_Obj **row;
+        if (Tcl_ListObjGetElements(interp, elems[i], &n_row, &row) != TCL_OK) return TCL_ERROR;
+        if (n_row != idx->dim) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Vector %d has dimension %d, expected %d", i, n_row, idx->dim));
+            return TCL_ERROR;
+        }
+        for (int d = 0; d < n_row; d++) {
+            double v;
+            if (Tcl_GetDoubleFromObj(interp, row[d], &v) != TCL_OK) return TCL_ERROR;
+            out[(size_t)i * idx->dim + d] = (float)v;
+        }
+    }
+    return TCL_OK;
+}
+
+static int index_create_cmd(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc < 3 || (objc - 3) % 2 != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::index create dim ?-metric cosine|l2|ip? ?-M n? ?-ef_construction n? ?-ef n?", -1));
+        return TCL_ERROR;
+    }
+
+    int dim, metric = METRIC_COSINE, M = 16, ef_construction = 200, ef = 64;
+    if (Tcl_GetIntFromObj(interp, objv[2], &dim) != TCL_OK) return TCL_ERROR;
+
+    for (int i = 3; i < objc; i += 2) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (strcmp(opt, "-metric") == 0) {
+            const char *m = Tcl_GetString(objv[i+1]);
+            if (strcmp(m, "cosine") == 0) metric = METRIC_COSINE;
+            else if (strcmp(m, "l2") == 0) metric = METRIC_L2;
+            else if (strcmp(m, "ip") == 0) metric = METRIC_IP;
+            else {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid metric \"%s\": must be cosine, l2 or ip", m));
+                return TCL_ERROR;
+            }
+        } else if (strcmp(opt, "-M") == 0) {
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &M) != TCL_OK) return TCL_ERROR;
+        } else if (strcmp(opt, "-ef_construction") == 0) {
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &ef_construction) != TCL_OK) return TCL_ERROR;
+        } else if (strcmp(opt, "-ef") == 0) {
+            if (Tcl_GetIntFromObj(interp, objv[i+1], &ef) != TCL_OK) return TCL_ERROR;
+        } else {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown option \"%s\"", opt));
+            return TCL_ERROR;
+        }
+    }
+
+    if (dim < 1 || dim > INDEX_DIM_MAX) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("dim must be between 1 and %d", INDEX_DIM_MAX));
+        return TCL_ERROR;
+    }
+    if (M < 2 || M > INDEX_M_MAX) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("M must be between 2 and %d", INDEX_M_MAX));
+        return TCL_ERROR;
+    }
+    if (ef_construction < 1 || ef < 1) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("ef_construction and ef must be positive", -1));
+        return TCL_ERROR;
+    }
+
+    index_register(interp, index_new(dim, metric, M, ef_construction, ef));
+    return TCL_OK;
+}
+
+static int index_add_cmd(Tcl_Interp *interp, VectorIndex *idx, int objc, Tcl_Obj *const objv[]) {
+    if (objc != 5) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::index add index idList vectors", -1));
+        return TCL_ERROR;
+    }
+
+    int n_ids;
+    Tcl_Obj **id_objs;
+    if (Tcl_ListObjGetElements(interp, objv[3], &n_ids, &id_objs) != TCL_OK) return TCL_ERROR;
+    if (n_ids == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)idx->count));
+        return TCL_OK;
+    }
+    if (idx->count + n_ids > (size_t)INT32_MAX) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Index is full", -1));
+        return TCL_ERROR;
+    }
+
+    std::vector<int64_t> ids(n_ids);
+    for (int i = 0; i < n_ids; i++) {
+        Tcl_WideInt w;
+        if (Tcl_GetWideIntFromObj(interp, id_objs[i], &w) != TCL_OK) return TCL_ERROR;
+        ids[i] = (int64_t)w;
+    }
+    std::vector<float> vecs;
+    if (index_get_vectors(interp, idx, objv[4], n_ids, vecs) != TCL_OK) return TCL_ERROR;
+
+    index_own(idx);
+
+    // Ids repetidos se rechazan antes de insertar nada
+    std::unordered_set<int64_t> batch_ids;
+    batch_ids.reserve(n_ids);
+    for (int i = 0; i < n_ids; i++) {
+        if (idx->by_id.count(ids[i]) != 0 || !batch_ids.insert(ids[i]).second) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Duplicate id %s", Tcl_GetString(id_objs[i])));
+            return TCL_ERROR;
+        }
+    }
+
+    for (int i = 0; i < n_ids; i++) {
+        index_insert(idx, ids[i], &vecs[(size_t)i * idx->dim]);
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)idx->count));
+    return TCL_OK;
+}
+
+static int index_query_cmd(Tcl_Interp *interp, VectorIndex *idx, int objc, Tcl_Obj *const objv[]) {
+    if (objc != 5 && objc != 7) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::index query index vector k ?-ef n?", -1));
+        return TCL_ERROR;
+    }
+
+    int k, ef = idx->ef_search;
+    if (Tcl_GetIntFromObj(interp, objv[4], &k) != TCL_OK) return TCL_ERROR;
+    if (objc == 7) {
+        if (strcmp(Tcl_GetString(objv[5]), "-ef") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown option \"%s\"", Tcl_GetString(objv[5])));
+            return TCL_ERROR;
+        }
+        if (Tcl_GetIntFromObj(interp, objv[6], &ef) != TCL_OK) return TCL_ERROR;
+    }
+    if (k < 1 || ef < 1) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("k and ef must be positive", -1));
+        return TCL_ERROR;
+    }
+
+    if (index_get_vectors(interp, idx, objv[3], 1, idx->qbuf) != TCL_OK) return TCL_ERROR;
+    float *q = idx->qbuf.data();
+    if (idx->metric == METRIC_COSINE) {
+        float norm = sqrtf(dot_scalar(q, q, idx->dim));
+        if (norm > 0.0f) {
+            for (int d = 0; d < idx->dim; d++) q[d] /= norm;
+        }
+    }
+
+    auto t_start = std::chrono::high_resolution_clock::now();
+    idx->n_dist = 0;
+    std::vector<Cand> found;
+    index_query(idx, q, k, ef, found);
+    auto t_end = std::chrono::high_resolution_clock::now();
+
+    idx->t_query_us = std::chrono::duration<double, std::micro>(t_end - t_start).count();
+    idx->t_query_us_total += idx->t_query_us;
+    idx->n_queries++;
+
+    // {id distancia} por resultado, del más cercano al más lejano. En l2 se
+    // reporta la distancia euclídea; en ip, el producto interno negado.
+    Tcl_Obj *res = Tcl_NewListObj(0, NULL);
+    for (size_t i = 0; i < found.size(); i++) {
+        double d = found[i].first;
+        if (idx->metric == METRIC_L2) d = sqrt(d);
+        Tcl_Obj *pair[2] = {
+            Tcl_NewWideIntObj((Tcl_WideInt)idx->p_ids[found[i].second]),
+            Tcl_NewDoubleObj(d)
+        };
+        Tcl_ListObjAppendElement(interp, res, Tcl_NewListObj(2, pair));
+    }
+    Tcl_SetObjResult(interp, res);
+    return TCL_OK;
+}
+
+static int index_info_cmd(Tcl_Interp *interp, VectorIndex *idx) {
+    size_t bytes = idx->count * (sizeof(int64_t) + idx->dim * sizeof(float) + sizeof(int32_t) +
+                                 (idx->M0 + 1) * sizeof(int32_t) + sizeof(uint32_t)) +
+                   idx->n_upper * sizeof(int32_t);
+
+    Tcl_Obj *dict = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("dim", -1), Tcl_NewIntObj(idx->dim));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("metric", -1), Tcl_NewStringObj(metric_names[idx->metric], -1));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj((Tcl_WideInt)idx->count));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("M", -1), Tcl_NewIntObj(idx->M));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("ef_construction", -1), Tcl_NewIntObj(idx->ef_construction));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("ef", -1), Tcl_NewIntObj(idx->ef_search));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("max_level", -1), Tcl_NewIntObj(idx->max_level));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("bytes", -1), Tcl_NewWideIntObj((Tcl_WideInt)bytes));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("mapped", -1), Tcl_NewIntObj(idx->map != NULL));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("kernel", -1), Tcl_NewStringObj(k_name, -1));
+
+    Tcl_Obj *telemetry = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_queries", -1), Tcl_NewWideIntObj(idx->n_queries));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("t_query_us", -1), Tcl_NewDoubleObj(idx->t_query_us));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("t_query_us_avg", -1),
+                   Tcl_NewDoubleObj(idx->n_queries > 0 ? idx->t_query_us_total / idx->n_queries : 0.0));
+    Tcl_DictObjPut(interp, telemetry, Tcl_NewStringObj("n_distances", -1), Tcl_NewWideIntObj(idx->n_dist));
+    Tcl_DictObjPut(interp, dict, Tcl_NewStringObj("telemetry", -1), telemetry);
+
+    Tcl_SetObjResult(interp, dict);
+    return TCL_OK;
+}
+
+static int Llama_Index_Cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    static const char *usage = "Usage: llama::index create|add|query|save|load|info|free ?arg ...?";
+    if (objc < 2) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(usage, -1));
+        return TCL_ERROR;
+    }
+
+    const char *sub = Tcl_GetString(objv[1]);
+    if (strcmp(sub, "create") == 0) {
+        return index_create_cmd(interp, objc, objv);
+    }
+    if (strcmp(sub, "load") == 0) {
+        if (objc != 3) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::index load file", -1));
+            return TCL_ERROR;
+        }
+        Tcl_DString native;
+        const char *path = Tcl_TranslateFileName(interp, Tcl_GetString(objv[2]), &native);
+        if (!path) return TCL_ERROR;
+        VectorIndex *idx = NULL;
+        int rc = index_load(interp, path, &idx);
+        Tcl_DStringFree(&native);
+        if (rc == TCL_OK) index_register(interp, idx);
+        return rc;
+    }
+
+    if (strcmp(sub, "add") != 0 && strcmp(sub, "query") != 0 && strcmp(sub, "save") != 0 &&
+        strcmp(sub, "info") != 0 && strcmp(sub, "free") != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(usage, -1));
+        return TCL_ERROR;
+    }
+    if (objc < 3) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Usage: llama::index %s index ?arg ...?", sub));
+        return TCL_ERROR;
+    }
+    VectorIndex *idx = index_from_obj(interp, objv[2]);
+    if (!idx) return TCL_ERROR;
+
+    if (strcmp(sub, "add") == 0) return index_add_cmd(interp, idx, objc, objv);
+    if (strcmp(sub, "query") == 0) return index_query_cmd(interp, idx, objc, objv);
+    if (strcmp(sub, "info") == 0) return index_info_cmd(interp, idx);
+
+    if (strcmp(sub, "save") == 0) {
+        if (objc != 4) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Usage: llama::index save index file", -1));
+            return TCL_ERROR;
+        }
+        Tcl_DString native;
+        const char *path = Tcl_TranslateFileName(interp, Tcl_GetString(objv[3]), &native);
+        if (!path) return TCL_ERROR;
+        int rc = index_save(interp, idx, path);
+        Tcl_DStringFree(&native);
+        return rc;
+    }
+
+    // free
+    index_free(idx);
+    Tcl_DeleteCommand(interp, Tcl_GetString(objv[2]));
+    return TCL_OK;
+}
+
+// Llamado desde Tclllama_Init
+int Tclllama_IndexInit(Tcl_Interp *interp) {
+    index_select_kernels();
+    Tcl_CreateObjCommand(interp, "llama::index", Llama_Index_Cmd, NULL, NULL);
+    return TCL_OK;
+}
+
+#ifdef __cplusplus
+}
+#endif